@@ -15,6 +15,8 @@
  * ==============================================================================
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -25,10 +27,136 @@
 #include <assert.h>
 #include <pthread.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <link.h>
+
+#include "trace.h"
+#include "probes.h"
+#include "numa.h"
 
+/* Log messages are on unless disabled with -DDEBUG=0 or compiled out by a
+ * release (-DNDEBUG) build */
 #ifndef DEBUG
+#ifdef NDEBUG
+#define DEBUG 0
+#else
 #define DEBUG 1
 #endif
+#endif
+
+/* Every pointer handed out is aligned to at least MIN_ALIGN bytes, which
+ * covers any fundamental type (long double included) on x86-64. */
+#define MIN_ALIGN 16
+
+/* Cache line size. In cache-line mode (see struct allocator_config), objects
+ * are aligned and padded to whole lines so that no two objects, and no
+ * object and a block header, ever share one. */
+#define CACHE_LINE 64
+
+/* Number of segregated free lists. Free space is binned by its power of two,
+ * so one list per bit of a size_t covers every block we could ever map. */
+#define NUM_BINS (sizeof(size_t) * CHAR_BIT)
+
+/* Requests up to SMALL_MAX bytes are rounded to a small size class, carved
+ * from headerless slabs (see struct slab) and served from a per-thread cache
+ * (see struct tcache). */
+#define SMALL_MAX 1024
+#define NUM_SMALL_CLASSES 20
+
+/* Slabs are SLAB_SIZE bytes, aligned to their size, and carved from a single
+ * SLAB_SPACE reservation so that any pointer can be recognized as a slab
+ * object by a range check. */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_SPACE (4UL * 1024 * 1024 * 1024)
+#define SLAB_MAP_WORDS (SLAB_SIZE / 16 / 64)
+
+/* Default number of blocks each thread cache bin may hold before half of
+ * them are flushed back to the shared heap, and how many blocks are
+ * allocated at once when a bin runs dry. */
+#define TCACHE_MAX 32
+#define TCACHE_BATCH 8
+
+/* A thread that frees into other arenas' remote lists (see remote_free)
+ * tries to drain the arena it frees into once every REMOTE_DRAIN frees, so
+ * memory does not pile up behind an arena nobody allocates from. */
+#define REMOTE_DRAIN 64
+
+/* By default, single-block regions at least this large are grown by realloc
+ * with mremap, which moves the pages instead of copying them. */
+#define REMAP_MIN (64 * 1024)
+
+/* By default, requests of at least LARGE_MIN bytes bypass the arenas and get
+ * a region of their own (see large_alloc). Up to LARGE_CACHE_SLOTS freed large
+ * regions no bigger than LARGE_CACHE_MAX are kept mapped for reuse. */
+#define LARGE_MIN (128 * 1024)
+#define LARGE_CACHE_SLOTS 8
+#define LARGE_CACHE_MAX (32 * 1024 * 1024)
+
+/* Arena regions whose last block is freed are retained for reuse rather than
+ * unmapped (see struct region_cache), up to RETAIN_SLOTS regions and
+ * RETAIN_MAX bytes by default. Cached regions idle for DECAY_MS are purged,
+ * and unmapped until no more than RETAIN_MIN bytes are left. */
+#define RETAIN_SLOTS 32
+#define RETAIN_MAX (16 * 1024 * 1024)
+#define RETAIN_MIN (2 * 1024 * 1024)
+#define DECAY_MS 1000
+
+/* Large regions of at least a huge page are aligned to one so transparent
+ * huge pages can back them. Set LARGE_HUGETLB to 1 to try explicitly
+ * reserved (MAP_HUGETLB) pages first for huge-page-multiple sizes by
+ * default. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#ifndef LARGE_HUGETLB
+#define LARGE_HUGETLB 0
+#endif
+
+/* The page map (see pagemap_get) covers 48-bit addresses at a 4 KiB page
+ * granularity with three levels of PAGEMAP_BITS bits each. */
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_BITS 12
+#define PAGEMAP_FANOUT (1UL << PAGEMAP_BITS)
+
+/* Hardened mode (see hardened_alloc): byte patterns written over new
+ * allocations, freed ones and the canary after each one, and the keys that
+ * mark an allocation's size word as live or freed. Up to QUARANTINE_SLOTS
+ * freed allocations, QUARANTINE_MAX bytes by default, are held back before
+ * their memory is reused. */
+#define POISON_ALLOC 0xAA
+#define POISON_FREE 0xDD
+#define CANARY_BYTE 0xC5
+#define HARDENED_LIVE 0x5AFEC0DEA110C8EDUL
+#define HARDENED_FREED 0xF8EEDB10C4F8EED0UL
+#define QUARANTINE_SLOTS 1024
+#define QUARANTINE_MAX (4 * 1024 * 1024)
+
+/* Heap profiling (see prof_alloc): stack frames kept per sample, and the
+ * capacity of the tables of distinct stacks and of live sampled objects. */
+#define PROF_DEPTH 32
+#define PROF_STACKS 4096
+#define PROF_LIVE 65536
+
+/* Upper bound on the number of independent heaps (see struct arena). */
+#define MAX_ARENAS 64
+
+/* NUMA mode: nodes told apart, and the memory policy regions get (the
+ * MPOL_PREFERRED of <linux/mempolicy.h>, see numa_bind). */
+#define MAX_NODES 64
+#define NUMA_MPOL_PREFERRED 1
+
+/* Statistics are kept per small size class, plus one slot each for arena
+ * blocks above SMALL_MAX and for large objects. */
+#define STAT_MEDIUM NUM_SMALL_CLASSES
+#define STAT_LARGE (NUM_SMALL_CLASSES + 1)
+#define NUM_STAT_CLASSES (NUM_SMALL_CLASSES + 2)
 
 
 #define LOG(fmt, ...) \
@@ -68,404 +196,4609 @@ struct mem_block {
 
     /* Next block in the chain */
     struct mem_block *next;
+
+    /* Previous block in the chain, so blocks and regions can be unlinked
+     * without searching for their predecessor */
+    struct mem_block *prev;
+
+    /* Arena whose region list this block lives on */
+    struct arena *arena;
+
+    /* Links for the segregated free list this block's free space is filed
+     * under (see bin_insert), or, under best_fit and worst_fit, its children
+     * in the arena's free space tree. Only meaningful while the block is
+     * binned. */
+    union {
+        struct {
+            struct mem_block *prev_free;
+            struct mem_block *next_free;
+        };
+        struct {
+            struct mem_block *left;
+            struct mem_block *right;
+        };
+    };
+
+    /* In the first block of a region, the number of blocks in the region
+     * that are in use; the region is retired when it drops to zero.
+     * Undefined in subsequent blocks. A large object keeps the NUMA node
+     * its region was placed on instead. */
+    union {
+        size_t live;
+        unsigned int node;
+    };
+} __attribute__((aligned(MIN_ALIGN)));
+
+/* Blocks are laid out back to back, so user data stays MIN_ALIGN-aligned
+ * only if the header size is a multiple of it. */
+_Static_assert(sizeof(struct mem_block) % MIN_ALIGN == 0,
+        "struct mem_block must preserve MIN_ALIGN");
+
+/**
+ * struct arena
+ * ==============================================================================
+ * An independent heap with its own region list, free lists and lock. Each
+ * thread allocates from one arena; blocks are always freed back to the arena
+ * that owns them, whichever thread frees them. Arenas start on a cache line
+ * of their own so that threads locking neighbouring arenas do not contend
+ * for the same line.
+ * ==============================================================================
+ */
+struct arena {
+    pthread_mutex_t lock;
+
+    /* Start (head) and end (tail) of this arena's linked list */
+    struct mem_block *head;
+    struct mem_block *tail;
+
+    /* Segregated free lists: bins[i] holds the blocks with between 2^i and
+     * 2^(i+1) - 1 bytes of free space. Bit i of bin_map is set whenever
+     * bins[i] is non-empty, so the smallest usable list is one ctz away. */
+    struct mem_block *bins[NUM_BINS];
+    unsigned long bin_map;
+
+    /* Under best_fit and worst_fit, the binned blocks are kept here instead:
+     * a treap ordered by (free space, address), so the tightest or loosest
+     * fit is found in O(log n) (see tree_insert). */
+    struct mem_block *tree;
+
+    /* Slabs of each small class that still have free objects */
+    struct slab *slabs[NUM_SMALL_CLASSES];
+
+    /* NUMA node the arena's regions and slabs are placed on (0 unless NUMA
+     * mode is on, see numa_init) */
+    unsigned int node;
+
+    /* Slab objects and blocks freed by threads using other arenas: a
+     * lock-free stack linked through the objects' first words, pushed
+     * without the lock and emptied by whoever takes it next (see
+     * remote_free). On a line of its own, as other threads write it. */
+    void *remote __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE)));
+
+/**
+ * struct slab
+ * ==============================================================================
+ * Descriptor at the start of every slab. Small objects carry no header of
+ * their own: the slab is found by masking an object's address, and the
+ * object's index in the slab selects its bit in free_map.
+ * ==============================================================================
+ */
+struct slab {
+    /* Arena this slab belongs to */
+    struct arena *arena;
+
+    /* Neighbours on the arena's list of partial slabs for this class, or on
+     * the list of released slabs */
+    struct slab *prev;
+    struct slab *next;
+
+    /* Small size class of the objects in this slab */
+    unsigned int cls;
+
+    /* Number of objects the slab holds, and how many are allocated */
+    unsigned int capacity;
+    unsigned int used;
+
+    /* Lowest word of free_map that may have a free object */
+    unsigned int hint;
+
+    /* Bit i is set while object i is free */
+    unsigned long free_map[SLAB_MAP_WORDS];
 };
 
-/* Start (head) of our linked list: */
-struct mem_block *g_head = NULL;
+/* Objects start on the first cache line after the descriptor, so every
+ * object of a class that is a multiple of an alignment up to SLAB_ALIGN is
+ * aligned to it. */
+#define SLAB_ALIGN CACHE_LINE
+#define SLAB_HEADER ((sizeof(struct slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1UL))
 
-/* Allocation counter: */
-unsigned long g_allocations = 0;
+/* Start of the slab reservation, how much of it has been handed out, and
+ * slabs that were emptied and released. g_slab_lock guards the last two. */
+static char *g_slab_space = NULL;
+static size_t g_slab_used = 0;
+static struct slab *g_free_slabs = NULL;
+static pthread_mutex_t g_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_slab_once = PTHREAD_ONCE_INIT;
+
+struct arena g_arenas[MAX_ARENAS];
+
+/* Number of arenas in use: one per online CPU, up to MAX_ARENAS. */
+unsigned int g_num_arenas = 0;
+
+/* Threads are handed arenas round-robin in the order they first allocate.
+ * In NUMA mode, arena i serves node i % g_num_nodes, and each node hands
+ * out its own arenas round-robin. */
+static unsigned int g_next_arena = 0;
+static unsigned int g_num_nodes = 1;
+static unsigned int g_node_next[MAX_NODES];
 
-pthread_mutex_t g_alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct arena *t_arena __attribute__((tls_model("initial-exec")));
+
+/* Frees this thread has handed to other arenas (see remote_free) */
+static __thread unsigned int t_remote_frees __attribute__((tls_model("initial-exec")));
+
+/* Large objects are tracked on a list of their own. g_large is never handed
+ * to a thread: only its lock, head and tail are used. */
+struct arena g_large = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 /**
- * print_memory
- * ===========================================================================
- * 
- * TODO: Avoid allocating memory for printf
- *
- * Prints out the current memory state, including both the regions and blocks.
- * Entries are printed in order, so there is an implied link from the topmost
- * entry to the next, and so on.
- * 
- * ===========================================================================
+ * struct pagemap_leaf
+ * ==============================================================================
+ * Bottom level of the page map: the owner of each page in a 16 MiB span of
+ * the address space. Every page of an arena region maps to the region's first
+ * block; a large object is reached through the page its data starts on, which
+ * maps to the object's header. Slab objects are recognized by slab_of and are
+ * not in the map. Nodes are mapped on first use and never freed, and entries
+ * are read without locks.
+ * ==============================================================================
  */
-void print_memory(void)
-{
-    puts("-- Current Memory State --");
-    struct mem_block *current_block = g_head;
-    struct mem_block *current_region = NULL;
-    while (current_block != NULL) {
-        if (current_block->region_start != current_region) {
-            current_region = current_block->region_start;
-            printf("[REGION] %p-%p %zu\n",
-                    current_region,
-                    (void *) current_region + current_region->region_size,
-                    current_region->region_size);
-        }
-        printf("[BLOCK]  %p-%p (%ld) %zu %zu %zu\n",
-                current_block,
-                (void *) current_block + current_block->size,
-                current_block->alloc_id,
-                current_block->size,
-                current_block->usage,
-                current_block->usage == 0
-                    ? 0 : current_block->usage - sizeof(struct mem_block));
-        current_block = current_block->next;
-    }
-    // free(current_block);
-}
+struct pagemap_leaf {
+    struct mem_block *owner[PAGEMAP_FANOUT];
+};
+
+struct pagemap_node {
+    struct pagemap_leaf *leaves[PAGEMAP_FANOUT];
+};
+
+static struct pagemap_node *g_pagemap[PAGEMAP_FANOUT];
 
 /**
- * write_memory
- * ====================================================
- * -File Logging
- * -Writes output from print_memory to a file
- * ====================================================
+ * struct region_cache
+ * ==============================================================================
+ * Freed regions kept mapped so the next region of a similar size costs
+ * neither an mmap nor fresh page faults. Entries are kept oldest first. Idle
+ * entries decay (see cache_decay): their pages are given back to the kernel
+ * first, and whole entries are unmapped later if the cache is above its low
+ * watermark.
+ * ==============================================================================
  */
-void write_memory(FILE *all_output){
-    puts("-- Current Memory State --");
-    struct mem_block *current_block = g_head;
-    struct mem_block *current_region = NULL;
-    while (current_block != NULL) {
-        if (current_block->region_start != current_region) {
-            current_region = current_block->region_start;
-            fprintf(all_output,"[REGION] %p-%p %zu\n",
-                    current_region,
-                    (void *) current_region + current_region->region_size,
-                    current_region->region_size);
-        }
-        fprintf(all_output,"[BLOCK]  %p-%p (%ld) %zu %zu %zu\n",
-                current_block,
-                (void *) current_block + current_block->size,
-                current_block->alloc_id,
-                current_block->size,
-                current_block->usage,
-                current_block->usage == 0
-                    ? 0 : current_block->usage - sizeof(struct mem_block));
-        current_block = current_block->next;
-    }
-}
+struct cached_region {
+    void *addr;
+    size_t size;
+
+    /* When the region was cached, in milliseconds (see now_ms) */
+    unsigned long stamp;
+
+    /* Pages were given back with MADV_FREE or MADV_DONTNEED; with the
+     * latter (zeroed), the region reads as zero when reused */
+    bool purged;
+    bool zeroed;
+
+    /* NUMA node the region was placed on; it is only reused there */
+    unsigned int node;
+};
+
+struct region_cache {
+    pthread_mutex_t lock;
+    struct cached_region slots[RETAIN_SLOTS];
+    int count;
+    size_t bytes;
+
+    /* Holds large-object regions, counted in g_large_mapped */
+    bool large;
+};
+
+_Static_assert(LARGE_CACHE_SLOTS <= RETAIN_SLOTS,
+        "the large region cache is a struct region_cache");
+
+/* Retained arena regions, and recently freed large-object regions */
+static struct region_cache g_retained = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct region_cache g_large_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .large = true
+};
 
 /**
- * reuse
- * ======================================================================
- * Checks to see if any free space available in the block of memory 
- * 
- * ======================================================================
+ * struct quarantine
+ * ==============================================================================
+ * Allocations freed in hardened mode, oldest first, held back so their memory
+ * is not handed out again right away. While an allocation sits here, its
+ * poison (or, with guard pages, its PROT_NONE mapping) catches writes through
+ * dangling pointers (see quarantine_evict). Taken before any arena lock.
+ * ==============================================================================
  */
-void *reuse(size_t size) {
-    // TODO: using free space management algorithms, find a block of memory that
-    // we can reuse. Return NULL if no suitable block is found.      
-    char *algo = getenv("ALLOCATOR_ALGORITHM");
-    if (algo == NULL) {
-         algo = "first_fit";
-        // algo = "best_fit";
-        // algo = "worst_fit";
-    }       
-    struct mem_block *stuff = g_head;
-
-    if (strcmp(algo, "first_fit") == 0) {
-        LOG("ADDRESS OF CURR: %p\n", stuff);
-        while(stuff != NULL){
-            LOG("Size and Usage of Stuff: %zu %zu\n", stuff->size, stuff->usage);
-            if((stuff->size - stuff->usage) > (size + sizeof(struct mem_block))){
-               return stuff; 
-            }
-            stuff = stuff->next;
-        }
-        return stuff;
-
-    } else if (strcmp(algo, "best_fit") == 0) {
-        size_t usage = INT16_MAX;
-        struct mem_block *new_stuff = NULL;
-        while(stuff != NULL){
-            if((stuff->size - stuff->usage) >= (size + sizeof(struct mem_block))){
-                if(stuff->size - stuff->usage <= usage) {
-                    usage = stuff->size - stuff->usage;
-                    new_stuff = stuff;
-                }
-            }
-            stuff = stuff->next;
-        }
-        return new_stuff;
-
-    } else if (strcmp(algo, "worst_fit") == 0) {
-        size_t small_usage = 0;
-        struct mem_block *new_stuff = NULL;
-        while(stuff != NULL){
-            if((stuff->size - stuff->usage) >= (size + sizeof(struct mem_block))){    
-                if((stuff->size - stuff->usage) >= small_usage) {
-                    small_usage = stuff->size - stuff->usage;
-                    new_stuff = stuff;
-                }
-            }
-            stuff = stuff->next;
-        }
-        return new_stuff;
+struct quarantine_entry {
+    void *ptr;
 
-    }
-    
+    /* Guarded allocations: the mapping to unmap on eviction; otherwise NULL */
+    void *map;
 
-    // return NULL if there are no memory regions that can be filled up
-    return NULL;
-}
+    /* Poisoned bytes at ptr, or the size of map */
+    size_t bytes;
+};
+
+struct quarantine {
+    pthread_mutex_t lock;
+    struct quarantine_entry slots[QUARANTINE_SLOTS];
+    unsigned int head;
+    unsigned int count;
+    size_t bytes;
+};
+
+static struct quarantine g_quarantine = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 /**
- * malloc
- * =======================================================================
- * -Allocate memory
- * -Has a pointer that directs to a location of the allocated memory
- * 
- * -Check first to see if any memory blocks in use can be reused
- * -Map new memory region if no memory blocks are used
- * 
- * =======================================================================
+ * struct profile
+ * ==============================================================================
+ * Heap profile built from sampled allocations (see prof_alloc). Each distinct
+ * allocation stack gets a prof_stack counting the sampled objects and bytes it
+ * allocated in total and still has live. Live samples are found again on free
+ * through an open-addressing table keyed by address, which free probes without
+ * the lock; removed entries stay as tombstones until the table is rebuilt into
+ * its spare copy. The tables are mapped once, at startup, and never grow.
+ * ==============================================================================
  */
-void *malloc(size_t propd_size)
-{
-    // TODO: allocate memory. You'll first check if you can reuse an existing
-    // block. If not, map a new memory region.
-    
-    /* Go through list and see if there are any free blocks that actually fit 
-     * what is going to be allocated into memory. */
-    
-    pthread_mutex_lock(&g_alloc_mutex);
+struct prof_stack {
+    /* Hash of the frames; 0 marks an unused entry */
+    uint64_t hash;
+    unsigned int depth;
+    void *frames[PROF_DEPTH];
+    uint64_t live_count;
+    uint64_t live_bytes;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+};
 
-    LOG("Allocation request; size = %zu\n", propd_size);
-    if (propd_size % 8 != 0){
-        propd_size = propd_size + (8 - propd_size % 8);
-    }
+/* Live table entry; ptr is PROF_EMPTY or PROF_DELETED when not in use */
+struct prof_live {
+    uintptr_t ptr;
+    size_t size;
+    unsigned int stack;
+};
 
-    struct mem_block *check_reusable = NULL;
-    check_reusable = reuse(propd_size);
-    
-    if (check_reusable != NULL){ 
+#define PROF_EMPTY 0
+#define PROF_DELETED 1
 
-        size_t real_sz = propd_size + sizeof(struct mem_block);
-        if (check_reusable->usage == 0){
-            check_reusable->alloc_id = g_allocations++;
-            check_reusable->size = real_sz;
-            if (getenv("ALLOCATOR_SCRIBBLE") != NULL && (strcmp(getenv("ALLOCATOR_SCRIBBLE"), "1") == 0)){
-                memset(check_reusable+1, 0xAA, propd_size);
-            }
+struct profile {
+    pthread_mutex_t lock;
+    struct prof_stack *stacks;
+    struct prof_live *live;
+    struct prof_live *spare;
 
-            pthread_mutex_unlock(&g_alloc_mutex);
-            return check_reusable + 1;
-        } else {
-            // Create a new block this_block that makes a new mapped memory region
-            struct mem_block *this_block = (void *) check_reusable + check_reusable->usage;
-            this_block->alloc_id = g_allocations++;
-            this_block->size = check_reusable->size - check_reusable->usage;
-            this_block->usage = real_sz;
-            this_block->region_start = check_reusable->region_start;
-            this_block->region_size = check_reusable->region_size;
-            this_block->next = check_reusable->next;
-
-            
-            // Update the reusable block's size to become its usage
-            check_reusable->size = check_reusable->usage;
-            check_reusable->next = this_block;
-
-            // Check for Scribbling
-            if((getenv("ALLOCATOR_SCRIBBLE") != NULL) && (strcmp(getenv("ALLOCATOR_SCRIBBLE"), "1") == 0)){
-                memset(this_block + 1, 0xAA, propd_size);
-            }
+    /* Stacks in use, and entries of live in use, tombstones included */
+    unsigned int nstacks;
+    unsigned int live_used;
 
-            pthread_mutex_unlock(&g_alloc_mutex);
-            return this_block + 1;
-        }
-        
-    }
-    
-    // Real size is Sum of proposed size and size of a mem_block struct
-    size_t real_sz = propd_size + sizeof(struct mem_block);
-    int page_sz = getpagesize();
-    size_t num_of_pages = real_sz / page_sz;
-    if((real_sz % page_sz) != 0){
-        num_of_pages++;
-    }
-    // New region size to be set to product of number of pages and page size
-    size_t region_sz = num_of_pages * page_sz;
-    
-    // mmap in alloc requests for a new memory region from the kernel
-    struct mem_block *block = mmap(
-        NULL, /* Address (we use NULL to let the kernel decide) */
-        region_sz, /* Size of memory block to allocate */
-        PROT_READ | PROT_WRITE, /* Memory protection flags */
-        MAP_PRIVATE | MAP_ANONYMOUS, /* Type of mapping */
-        -1, /* file descriptor */
-        0 /* Offset to start at within the file */);
-
-    if (block == MAP_FAILED){
-        perror("mmap");
-        pthread_mutex_unlock(&g_alloc_mutex);
-        return NULL;
-    }
+    /* Code of the allocator's own object, skipped at the top of stacks */
+    uintptr_t self_start;
+    uintptr_t self_end;
+};
 
-    block->alloc_id = g_allocations++;
-    block->size = region_sz;
-    block->region_start = block;
-    block->region_size = region_sz;
-    block->usage = real_sz;  // Usage
-    block->next = NULL;   
+static struct profile g_prof = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-    if (g_head == NULL){
-        g_head = block;
-    } else{
-        struct mem_block *curr = g_head;
-        while (curr != NULL){
-            if (curr->next == NULL){
-                // LOG("Linking %p to %p\n", curr, block);
-                curr->next = block;
-                break;
-            }
-	        curr = curr->next;
-        }
-    }
+/* Mean bytes between samples, or 0 while profiling is off */
+static size_t g_prof_rate = 0;
 
-    // Check Scribbling for newly mapped region and overwrite the block/region
-    // if(getenv("ALLOCATOR_SCRIBBLE")){
-    if((getenv("ALLOCATOR_SCRIBBLE") != NULL) && (strcmp(getenv("ALLOCATOR_SCRIBBLE"), "1") == 0)){
+/* Per thread: bytes left until the next sample, the state of the generator
+ * drawing sample intervals (0 until seeded), and whether a sample is being
+ * taken, as backtrace() may allocate */
+static __thread size_t t_prof_left __attribute__((tls_model("initial-exec")));
+static __thread uint64_t t_prof_seed __attribute__((tls_model("initial-exec")));
+static __thread bool t_prof_busy __attribute__((tls_model("initial-exec")));
 
-        memset(block + 1, 0xAA, propd_size);
-    }
+#define PROF_ALLOC(ptr, size) \
+    do { if (__builtin_expect(g_prof_rate != 0, 0) && (ptr) != NULL) \
+        prof_alloc((ptr), (size)); } while (0)
+#define PROF_FREE(ptr) \
+    do { if (__builtin_expect(g_prof_rate != 0, 0) && (ptr) != NULL) \
+        prof_free(ptr); } while (0)
 
-    // Unlock the thread
-    pthread_mutex_unlock(&g_alloc_mutex);
-    return block + 1;
-}
+/* Allocation counter: */
+unsigned long g_allocations = 0;
+
+/* Usable sizes of the small size classes, in bytes. */
+static const size_t g_small_classes[NUM_SMALL_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024,
+};
+
+/* Class each small class's requests are served from: itself, unless
+ * cache-line mode moves it up to a multiple of CACHE_LINE. */
+static unsigned char g_class_map[NUM_SMALL_CLASSES];
 
 /**
- * free
- * ====================================================================
- * Frees any used memory so as to prevent any segmentation faults. 
- * Clears memory and offers opportunity to create visual picture of 
- * the memory being allocated and replaced with other blocks. 
- * ==================================================================== 
+ * struct alloc_stats
+ * ==============================================================================
+ * Allocation counters. Each thread updates its own copy without locking;
+ * copies are only summed when statistics are requested (see stats_collect).
+ * Byte counts are of usable sizes.
+ * ==============================================================================
  */
-void free(void *ptr)
-{   
-    /* 
-        This is separate code that is used to send all information from the 
-        memory output to a text file. This text file will call the script
-        file in tests/viz in order to create a .png image file showing the
-        visualization of the memory allocation program. 
-    */
+struct alloc_stats {
+    unsigned long nmalloc[NUM_STAT_CLASSES];
+    unsigned long nfree[NUM_STAT_CLASSES];
+    unsigned long nrealloc;
+    size_t allocated;
+    size_t freed;
 
-    if (ptr == NULL) {
-        /* Freeing a NULL pointer does nothing */
-        return;
-    }
+    /* Lock acquisitions that had to wait for another thread */
+    unsigned long contended;
 
-    // FILE *file_pic = fopen("tests/viz/mem.txt", "w");
-    // write_memory(file_pic);
+    /* Frees handed to another arena's remote list */
+    unsigned long remote;
+};
+
+/**
+ * struct tcache
+ * ==============================================================================
+ * Per-thread cache of recently freed small blocks, one LIFO list per size
+ * class. Cached blocks still look allocated to the shared heap; the list is
+ * threaded through their first word. Hits never take an arena lock.
+ * ==============================================================================
+ */
+struct tcache_bin {
+    void *head;
+    unsigned int count;
+};
 
-    pthread_mutex_lock(&g_alloc_mutex);
+struct tcache {
+    struct tcache_bin bins[NUM_SMALL_CLASSES];
 
-    // Check to see if the block can be freed if applicable
-    bool check_to_free = true; 
-   
+    /* Set once the thread's exit destructor has been registered */
+    bool registered;
 
-    struct mem_block *block = (struct mem_block*) ptr - 1;
-    // LOG("Free request on allocation = %lu\n", block->alloc_id);
-    block->usage = 0;
+    /* Set by the exit destructor; the cache must not be refilled after */
+    bool dead;
 
-    // TODO: algorithm for figuring out if we can free a region:
-    // 1. go to region start                                    
-    // 2. traverse through the linked list                      
-    // 3. stop when you:                                       
-    //     a. find something that's not free                    
-    //     b. when you find the start of a different region     
-    // 4. if (a) move on; if (b) then munmap 
-    struct mem_block *curr_block = block->region_start;
-    // LOG("Other Block = %p\n", block->region_start);
-
-    while (curr_block != NULL && (curr_block->region_start == block->region_start)) {
-        if (curr_block->usage != 0){
-            check_to_free = false;
-            // pthread_mutex_unlock(&g_alloc_mutex);
-            // return;
-	        break;
-        }
-        curr_block = curr_block->next;
-    }
-    /* Update the linked list */      
-    if (check_to_free){
-        if (g_head == block->region_start) {                                        
-            g_head = curr_block;                                     
-        } else {                                                    
-            struct mem_block *temp = g_head;                        
-            while (temp->next != NULL && (temp->next != block->region_start)){
-                temp = temp->next;                                  
-            }     
-            LOG("Temporary block: %p\n", temp);	
-            temp->next = curr_block;                                 
-        }                                                           
-                                                                
-        // TODO: free memory. If the containing region is empty (i.e., there are no
-        // more blocks in use), then it should be unmapped.
-
-        int ret = munmap(block->region_start, block->region_size);
-        if (ret == -1) {                                            
-            perror("munmap");                                       
-        }  
-    }                                                      
-   
-    pthread_mutex_unlock(&g_alloc_mutex);
-}
+    /* This thread's allocation counters */
+    struct alloc_stats stats;
+
+    /* Neighbours on the list of live threads (g_threads) */
+    struct tcache *prev_thread;
+    struct tcache *next_thread;
+};
+
+static __thread struct tcache t_cache __attribute__((tls_model("initial-exec")));
 
+static pthread_key_t g_tcache_key;
+static pthread_once_t g_tcache_once = PTHREAD_ONCE_INIT;
+
+/* Every thread with a cache, and the counters of threads that have exited.
+ * Both are guarded by g_stats_lock. */
+static struct tcache *g_threads = NULL;
+static struct alloc_stats g_exited_stats;
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes currently mapped from the kernel (and the peak), how many of them
+ * back large objects, and the number of mapping syscalls made. */
+static size_t g_mapped = 0;
+static size_t g_peak_mapped = 0;
+static size_t g_large_mapped = 0;
+static unsigned long g_nmmap = 0;
+static unsigned long g_nmunmap = 0;
 
 /**
- * calloc
- * ==================================================================== 
- * While free appears to clear the memory it does not 
- * actually "clear" details of memory
- * 
- * Need to set everything to 0 instead of leaving out wasted memory
- * 
- * ====================================================================
+ * stats_fold
+ * ==============================================================================
+ * Adds one set of counters into another.
+ * ==============================================================================
  */
-void *calloc(size_t nmemb, size_t size)
+static void stats_fold(struct alloc_stats *total, const struct alloc_stats *add)
 {
-    // size_t check_size = nmemb * size;
-    void *ptr = malloc(nmemb * size);
-    // memset(ptr, 0, check_size);
-    memset(ptr, 0, nmemb * size);
-    return ptr;
+    for (int i = 0; i < NUM_STAT_CLASSES; i++) {
+        total->nmalloc[i] += add->nmalloc[i];
+        total->nfree[i] += add->nfree[i];
+    }
+    total->nrealloc += add->nrealloc;
+    total->allocated += add->allocated;
+    total->freed += add->freed;
+    total->contended += add->contended;
+    total->remote += add->remote;
 }
 
+static void *alloc_block(struct arena *arena, size_t propd_size, size_t align,
+        bool *zeroed);
+static void free_block(struct mem_block *block);
+static struct tcache *tcache_get(void);
+static void arena_lock(struct arena *arena);
+static void remote_drain(struct arena *arena);
+static void remote_free(struct arena *arena, void *first, void *last,
+        unsigned int count);
+static void stats_map(size_t bytes);
+static void stats_unmap(size_t bytes);
+static void decay_start(void);
+static unsigned int small_class(size_t size);
+static void dump_signal(int sig);
+static void *hardened_alloc(size_t size, size_t align);
+static void hardened_free(void *ptr);
+static void *hardened_realloc(void *ptr, size_t size);
+static size_t hardened_size(void *ptr);
+static bool hardened(void);
+static void prof_init(void);
+static void prof_alloc(void *ptr, size_t size);
+static struct prof_live prof_free(void *ptr);
+static void prof_signal(int sig);
+
+typedef struct mem_block *(*fit_fn)(struct arena *arena, size_t need);
+static struct mem_block *first_fit(struct arena *arena, size_t need);
+static struct mem_block *best_fit(struct arena *arena, size_t need);
+static struct mem_block *worst_fit(struct arena *arena, size_t need);
 
 /**
- * realloc
- * ================================================================================
- * Changes the size of the memory block pointed to by ptr to size bytes. 
- * 
- * Frees the pointer and like malloc also re-aligns the memory blocks such that 
- * each request is 8 bytes each. 
- * 
- * Allocates memory if there is a null pointer to this function with respect to 
- * the proposed size. 
- * ================================================================================
+ * struct allocator_config
+ * ==============================================================================
+ * Tunables, read from the environment once when the library is loaded (see
+ * config_load) so that allocation paths never call getenv.
+ * ==============================================================================
  */
-void *realloc(void *ptr, size_t size)
-{
-    if (size % 8 != 0) {                              
-        size = size + (8 - size % 8);                 
-        LOG("Aligned size: %zu\n", size);             
-    }                                                 
-    if (ptr == NULL) {
-        return malloc(size);
-    }
-    // TODO: reallocation logic
-    if (size == 0){
-        free(ptr);
-        return NULL;
-    }
+struct allocator_config {
+    /* Free space management algorithm used by reuse() */
+    fit_fn fit;
 
-    return NULL;
-}
+    /* Fill new allocations with 0xAA */
+    bool scribble;
+
+    /* Number of arenas; 0 means one per online CPU */
+    unsigned int arenas;
+
+    /* Thread cache bin capacity and refill batch size */
+    unsigned int tcache_max;
+    unsigned int tcache_batch;
+
+    /* Smallest single-block region realloc grows with mremap */
+    size_t remap_min;
+
+    /* Smallest request served by the large-object path, how many freed
+     * large regions are cached, and the biggest one that may be cached */
+    size_t large_min;
+    unsigned int large_cache;
+    size_t large_cache_max;
+
+    /* Retained arena regions: at most retain_max bytes are kept (high
+     * watermark), and decay unmaps idle regions down to retain_min (low
+     * watermark) once they have been idle for decay_ms. decay_thread runs
+     * decay in the background instead of only when regions are freed. */
+    size_t retain_max;
+    size_t retain_min;
+    unsigned long decay_ms;
+    bool decay_thread;
+
+    /* Try MAP_HUGETLB for huge-page-multiple large regions */
+    bool hugetlb;
 
+    /* Print malloc_stats() at exit */
+    bool stats;
 
+    /* Cache-line mode: bit i of cacheline_classes selects small class i,
+     * whose requests are then served from the first class that is a
+     * multiple of CACHE_LINE (see g_class_map); cacheline_blocks does the
+     * same for arena blocks and large objects, which are aligned to
+     * CACHE_LINE, padded to whole lines and keep their headers on lines of
+     * their own. */
+    unsigned long cacheline_classes;
+    bool cacheline_blocks;
+
+    /* Trace file (empty when tracing is off); "%p" is replaced by the
+     * process id. trace_records is the capacity of its ring. */
+    char trace[PATH_MAX];
+    size_t trace_records;
+
+    /* Signal that writes a memory dump (0 for none), and the file it goes
+     * to (stderr when empty); "%p" is replaced by the process id. */
+    int dump_signal;
+    char dump[PATH_MAX];
+
+    /* Hardened mode: allocations are poisoned and followed by a canary,
+     * and freed ones are poisoned and quarantined (up to quarantine bytes)
+     * before reuse. guard also puts every allocation on pages of its own,
+     * ending at a PROT_NONE guard page. */
+    bool hardened;
+    bool guard;
+    size_t quarantine;
+
+    /* Heap profiling: one allocation is sampled per prof_sample bytes on
+     * average (0 disables it). The profile is written to prof at exit and
+     * whenever prof_signal (if not 0) is received. */
+    size_t prof_sample;
+    char prof[PATH_MAX];
+    int prof_signal;
+
+    /* NUMA mode: each node gets arenas and cached regions of its own, and
+     * memory freed on another node goes back to its owner (see numa_init) */
+    bool numa;
+};
+
+static struct allocator_config g_config = {
+    .fit = first_fit,
+    .scribble = false,
+    .arenas = 0,
+    .tcache_max = TCACHE_MAX,
+    .tcache_batch = TCACHE_BATCH,
+    .remap_min = REMAP_MIN,
+    .large_min = LARGE_MIN,
+    .large_cache = LARGE_CACHE_SLOTS,
+    .large_cache_max = LARGE_CACHE_MAX,
+    .retain_max = RETAIN_MAX,
+    .retain_min = RETAIN_MIN,
+    .decay_ms = DECAY_MS,
+    .decay_thread = false,
+    .hugetlb = LARGE_HUGETLB,
+    .stats = false,
+    .trace = "",
+    .trace_records = TRACE_RECORDS,
+    .dump_signal = 0,
+    .dump = "",
+    .hardened = false,
+    .guard = false,
+    .quarantine = QUARANTINE_MAX,
+    .prof_sample = 0,
+    .prof = "",
+    .prof_signal = 0,
+    .numa = false,
+};
 
+/* Whether hardened mode is on: -1 until the configuration is loaded, then
+ * 0 or 1. The public entry points test it once per call, so a normal build
+ * pays one predictable branch for the mode (see HARDENED). */
+static int g_hardened = -1;
 
+#define HARDENED() (__builtin_expect(g_hardened != 0, 0) && hardened())
+
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+/**
+ * parse_size
+ * ===========================================================================
+ * Reads a byte count with an optional k, m or g suffix.
+ * ===========================================================================
+ */
+static size_t parse_size(const char *val)
+{
+    char *end;
+    size_t num = strtoul(val, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return num << 10;
+        case 'm': case 'M': return num << 20;
+        case 'g': case 'G': return num << 30;
+        default: return num;
+    }
+}
+
+/**
+ * parse_fit
+ * ===========================================================================
+ * Maps a free space management algorithm name to its implementation, or
+ * NULL if the name is not recognized.
+ * ===========================================================================
+ */
+static fit_fn parse_fit(const char *name, size_t len)
+{
+    if (len == strlen("first_fit") && strncmp(name, "first_fit", len) == 0) {
+        return first_fit;
+    } else if (len == strlen("best_fit") && strncmp(name, "best_fit", len) == 0) {
+        return best_fit;
+    } else if (len == strlen("worst_fit") && strncmp(name, "worst_fit", len) == 0) {
+        return worst_fit;
+    }
+    return NULL;
+}
+
+/**
+ * config_path
+ * ===========================================================================
+ * Copies a path of len bytes into buf (PATH_MAX bytes), replacing "%p" with
+ * the process id so traced programs that run others do not share a file.
+ * ===========================================================================
+ */
+static void config_path(char *buf, const char *path, size_t len)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < len && out < PATH_MAX - 1; i++) {
+        if (path[i] == '%' && i + 1 < len && path[i + 1] == 'p') {
+            out += snprintf(buf + out, PATH_MAX - out, "%d", (int) getpid());
+            i++;
+        } else {
+            buf[out++] = path[i];
+        }
+    }
+    if (out > PATH_MAX - 1) {
+        out = PATH_MAX - 1;
+    }
+    buf[out] = '\0';
+}
+
+/**
+ * parse_cacheline
+ * ===========================================================================
+ * Reads the cacheline option: "all", or a '/'-separated list of request
+ * sizes, each selecting its small class, or every arena block and large
+ * object for sizes above SMALL_MAX.
+ * ===========================================================================
+ */
+static void parse_cacheline(const char *val, size_t len)
+{
+    if (len == strlen("all") && strncmp(val, "all", len) == 0) {
+        g_config.cacheline_classes = (1UL << NUM_SMALL_CLASSES) - 1;
+        g_config.cacheline_blocks = true;
+        return;
+    }
+    const char *end = val + len;
+    while (val < end) {
+        size_t size = parse_size(val);
+        if (size > SMALL_MAX) {
+            g_config.cacheline_blocks = true;
+        } else if (size > 0) {
+            g_config.cacheline_classes |= 1UL << small_class(size);
+        }
+        while (val < end && *val != '/') {
+            val++;
+        }
+        val++;
+    }
+}
+
+/**
+ * config_set
+ * ===========================================================================
+ * Applies a single key:value pair from ALLOCATOR_CONFIG. The value runs to
+ * the next comma or the end of the string.
+ * ===========================================================================
+ */
+static void config_set(const char *key, size_t key_len, const char *val,
+        size_t val_len)
+{
+#define KEY_IS(name) (key_len == strlen(name) && strncmp(key, name, key_len) == 0)
+    if (KEY_IS("algorithm")) {
+        fit_fn fit = parse_fit(val, val_len);
+        if (fit != NULL) {
+            g_config.fit = fit;
+        }
+    } else if (KEY_IS("scribble")) {
+        g_config.scribble = parse_size(val) != 0;
+    } else if (KEY_IS("arenas")) {
+        g_config.arenas = parse_size(val);
+    } else if (KEY_IS("tcache_max")) {
+        g_config.tcache_max = parse_size(val);
+    } else if (KEY_IS("tcache_batch")) {
+        g_config.tcache_batch = parse_size(val);
+    } else if (KEY_IS("remap_min")) {
+        g_config.remap_min = parse_size(val);
+    } else if (KEY_IS("large_min")) {
+        g_config.large_min = parse_size(val);
+    } else if (KEY_IS("large_cache")) {
+        g_config.large_cache = parse_size(val);
+    } else if (KEY_IS("large_cache_max")) {
+        g_config.large_cache_max = parse_size(val);
+    } else if (KEY_IS("retain_max")) {
+        g_config.retain_max = parse_size(val);
+    } else if (KEY_IS("retain_min")) {
+        g_config.retain_min = parse_size(val);
+    } else if (KEY_IS("decay_ms")) {
+        g_config.decay_ms = parse_size(val);
+    } else if (KEY_IS("decay_thread")) {
+        g_config.decay_thread = parse_size(val) != 0;
+    } else if (KEY_IS("hugetlb")) {
+        g_config.hugetlb = parse_size(val) != 0;
+    } else if (KEY_IS("stats")) {
+        g_config.stats = parse_size(val) != 0;
+    } else if (KEY_IS("cacheline")) {
+        parse_cacheline(val, val_len);
+    } else if (KEY_IS("trace")) {
+        config_path(g_config.trace, val, val_len);
+    } else if (KEY_IS("trace_records")) {
+        g_config.trace_records = parse_size(val);
+    } else if (KEY_IS("dump_signal")) {
+        g_config.dump_signal = parse_size(val);
+    } else if (KEY_IS("dump")) {
+        config_path(g_config.dump, val, val_len);
+    } else if (KEY_IS("hardened")) {
+        g_config.hardened = parse_size(val) != 0;
+    } else if (KEY_IS("guard")) {
+        g_config.guard = parse_size(val) != 0;
+    } else if (KEY_IS("quarantine")) {
+        g_config.quarantine = parse_size(val);
+    } else if (KEY_IS("prof_sample")) {
+        g_config.prof_sample = parse_size(val);
+    } else if (KEY_IS("prof")) {
+        config_path(g_config.prof, val, val_len);
+    } else if (KEY_IS("prof_signal")) {
+        g_config.prof_signal = parse_size(val);
+    } else if (KEY_IS("numa")) {
+        g_config.numa = parse_size(val) != 0;
+    } else {
+        LOG("Unknown ALLOCATOR_CONFIG key: %.*s\n", (int) key_len, key);
+    }
+#undef KEY_IS
+}
+
+/**
+ * config_load
+ * ===========================================================================
+ * Fills in g_config from the environment. ALLOCATOR_ALGORITHM,
+ * ALLOCATOR_SCRIBBLE, ALLOCATOR_STATS and ALLOCATOR_TRACE are read first;
+ * ALLOCATOR_CONFIG, a comma-separated
+ * list of key:value pairs such as "algorithm:best_fit,arenas:4,large_min:1m",
+ * can set any tunable and takes precedence. Out-of-range values are clamped.
+ * ===========================================================================
+ */
+static void config_load(void)
+{
+    char *algo = getenv("ALLOCATOR_ALGORITHM");
+    if (algo != NULL && parse_fit(algo, strlen(algo)) != NULL) {
+        g_config.fit = parse_fit(algo, strlen(algo));
+    }
+    char *scribble = getenv("ALLOCATOR_SCRIBBLE");
+    if (scribble != NULL && strcmp(scribble, "1") == 0) {
+        g_config.scribble = true;
+    }
+    char *stats = getenv("ALLOCATOR_STATS");
+    if (stats != NULL && strcmp(stats, "1") == 0) {
+        g_config.stats = true;
+    }
+    char *trace = getenv("ALLOCATOR_TRACE");
+    if (trace != NULL) {
+        config_path(g_config.trace, trace, strlen(trace));
+    }
+
+    const char *conf = getenv("ALLOCATOR_CONFIG");
+    while (conf != NULL && *conf != '\0') {
+        const char *sep = strchr(conf, ':');
+        if (sep == NULL) {
+            break;
+        }
+        const char *end = strchr(sep + 1, ',');
+        if (end == NULL) {
+            end = sep + 1 + strlen(sep + 1);
+        }
+        config_set(conf, sep - conf, sep + 1, end - (sep + 1));
+        conf = *end == ',' ? end + 1 : end;
+    }
+
+    if (g_config.arenas > MAX_ARENAS) {
+        g_config.arenas = MAX_ARENAS;
+    }
+    if (g_config.tcache_batch < 1) {
+        g_config.tcache_batch = 1;
+    }
+    if (g_config.large_min <= SMALL_MAX) {
+        g_config.large_min = SMALL_MAX + 1;
+    }
+    if (g_config.large_cache > LARGE_CACHE_SLOTS) {
+        g_config.large_cache = LARGE_CACHE_SLOTS;
+    }
+    if (g_config.retain_min > g_config.retain_max) {
+        g_config.retain_min = g_config.retain_max;
+    }
+    if (g_config.trace_records < 1) {
+        g_config.trace_records = 1;
+    }
+    if (g_config.dump_signal < 0 || g_config.dump_signal >= NSIG) {
+        g_config.dump_signal = 0;
+    }
+    if (g_config.guard) {
+        g_config.hardened = true;
+    }
+    if (g_config.prof_signal < 0 || g_config.prof_signal >= NSIG) {
+        g_config.prof_signal = 0;
+    }
+    if (g_config.prof_sample != 0 && g_config.prof[0] == '\0') {
+        config_path(g_config.prof, "allocator.%p.heap", strlen("allocator.%p.heap"));
+    }
+
+    for (unsigned int cls = 0; cls < NUM_SMALL_CLASSES; cls++) {
+        unsigned int served = cls;
+        if (g_config.cacheline_classes & (1UL << cls)) {
+            while (g_small_classes[served] % CACHE_LINE != 0) {
+                served++;
+            }
+        }
+        g_class_map[cls] = served;
+    }
+}
+
+/* Trace ring (see trace.h), mapped only while tracing */
+static struct trace_header *g_trace = NULL;
+static struct trace_record *g_trace_records = NULL;
+static uint64_t g_trace_epoch = 0;
+static __thread uint32_t t_tid __attribute__((tls_model("initial-exec")));
+
+static uint64_t trace_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * trace_open
+ * ===========================================================================
+ * Creates the trace file and maps its ring shared, so records reach the
+ * file without any write calls and survive the process crashing.
+ * ===========================================================================
+ */
+static void trace_open(void)
+{
+    if (g_config.trace[0] == '\0') {
+        return;
+    }
+
+    size_t len = sizeof(struct trace_header)
+        + g_config.trace_records * sizeof(struct trace_record);
+    int fd = open(g_config.trace, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+    if (ftruncate(fd, len) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return;
+    }
+    struct trace_header *trace = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (trace == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+
+    memcpy(trace->magic, TRACE_MAGIC, sizeof(trace->magic));
+    trace->version = TRACE_VERSION;
+    trace->record_size = sizeof(struct trace_record);
+    trace->capacity = g_config.trace_records;
+    trace->next = 0;
+    g_trace_records = (struct trace_record *) (trace + 1);
+    g_trace_epoch = trace_clock();
+    __atomic_store_n(&g_trace, trace, __ATOMIC_RELEASE);
+}
+
+/**
+ * trace_claim
+ * ===========================================================================
+ * Claims the next slot of the trace ring, with a single atomic increment,
+ * and stamps it with the time and thread; trace_fill completes it. Nothing
+ * is allocated and no lock is taken. An operation that releases memory
+ * before its outcome is known claims its slot first, so that the record
+ * precedes that of any allocation reusing the memory.
+ * ===========================================================================
+ */
+static struct trace_record *trace_claim(void)
+{
+    if (t_tid == 0) {
+        t_tid = gettid();
+    }
+    uint64_t idx = __atomic_fetch_add(&g_trace->next, 1, __ATOMIC_RELAXED);
+    struct trace_record *rec = &g_trace_records[idx % g_trace->capacity];
+    rec->time = trace_clock() - g_trace_epoch;
+    rec->tid = t_tid;
+    return rec;
+}
+
+static void trace_fill(struct trace_record *rec, uint32_t op, void *addr,
+        uint64_t arg, size_t size)
+{
+    rec->addr = (uintptr_t) addr;
+    rec->arg = arg;
+    rec->size = size;
+    rec->op = op;
+}
+
+/**
+ * trace_log
+ * ===========================================================================
+ * Appends one operation to the trace ring.
+ * ===========================================================================
+ */
+static void trace_log(uint32_t op, void *addr, uint64_t arg, size_t size)
+{
+    trace_fill(trace_claim(), op, addr, arg, size);
+}
+
+#define TRACE(op, addr, arg, size) \
+    do { if (g_trace != NULL) trace_log((op), (addr), (arg), (size)); } while (0)
+
+/**
+ * numa_init
+ * ===========================================================================
+ * Counts the NUMA nodes when NUMA mode is on, from the highest node the
+ * kernel lists as online. The list is read with open and read, as this may
+ * run inside the first malloc. On a single node the mode stays off.
+ * ===========================================================================
+ */
+static void numa_init(void)
+{
+    if (!g_config.numa) {
+        return;
+    }
+
+    char buf[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+
+    unsigned long nodes = numa_node_count(buf);
+    if (nodes > 1) {
+        g_num_nodes = nodes < MAX_NODES ? nodes : MAX_NODES;
+    }
+}
+
+/**
+ * numa_bind
+ * ===========================================================================
+ * In NUMA mode, has the pages of a range that were never touched (or were
+ * dropped) placed on node when they are next faulted in. MPOL_PREFERRED
+ * falls back to other nodes instead of failing when the node runs out of
+ * memory. glibc has no mbind wrapper, so the system call is made directly;
+ * placement is only a hint, and failures are ignored.
+ * ===========================================================================
+ */
+static void numa_bind(void *addr, size_t len, unsigned int node)
+{
+    if (g_num_nodes == 1) {
+        return;
+    }
+    int saved_errno = errno;
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, len, NUMA_MPOL_PREFERRED, &mask, MAX_NODES + 1, 0);
+    errno = saved_errno;
+}
+
+/**
+ * allocator_init
+ * ===========================================================================
+ * One-time setup: loads the configuration, then sizes the arena table (one
+ * arena per online CPU unless configured otherwise, and at least one per
+ * node in NUMA mode), initializes every arena lock and opens the trace file
+ * if tracing is on.
+ * ===========================================================================
+ */
+static void allocator_init(void)
+{
+    config_load();
+    numa_init();
+
+    long cpus = g_config.arenas;
+    if (cpus == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (cpus < (long) g_num_nodes) {
+        cpus = g_num_nodes;
+    } else if (cpus > MAX_ARENAS) {
+        cpus = MAX_ARENAS;
+    }
+    for (int i = 0; i < cpus; i++) {
+        pthread_mutex_init(&g_arenas[i].lock, NULL);
+        g_arenas[i].node = i % g_num_nodes;
+    }
+    g_num_arenas = cpus;
+    trace_open();
+    __atomic_store_n(&g_hardened, g_config.hardened, __ATOMIC_RELEASE);
+}
+
+/**
+ * fork_prepare
+ * ===========================================================================
+ * Takes every allocator lock before fork, so the child gets a consistent
+ * heap whatever the other threads were doing. Locks are taken in the order
+ * the allocator nests them: the profile, the quarantine, arenas, then the
+ * large-object tracker, the slab space, both region caches and the
+ * statistics.
+ * ===========================================================================
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&g_prof.lock);
+    pthread_mutex_lock(&g_quarantine.lock);
+    for (unsigned int i = 0; i < g_num_arenas; i++) {
+        pthread_mutex_lock(&g_arenas[i].lock);
+    }
+    pthread_mutex_lock(&g_large.lock);
+    pthread_mutex_lock(&g_slab_lock);
+    pthread_mutex_lock(&g_retained.lock);
+    pthread_mutex_lock(&g_large_cache.lock);
+    pthread_mutex_lock(&g_stats_lock);
+}
+
+/**
+ * fork_parent
+ * ===========================================================================
+ * Releases the locks taken by fork_prepare once the child has been created.
+ * ===========================================================================
+ */
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&g_stats_lock);
+    pthread_mutex_unlock(&g_large_cache.lock);
+    pthread_mutex_unlock(&g_retained.lock);
+    pthread_mutex_unlock(&g_slab_lock);
+    pthread_mutex_unlock(&g_large.lock);
+    for (unsigned int i = g_num_arenas; i > 0; i--) {
+        pthread_mutex_unlock(&g_arenas[i - 1].lock);
+    }
+    pthread_mutex_unlock(&g_quarantine.lock);
+    pthread_mutex_unlock(&g_prof.lock);
+}
+
+/**
+ * fork_child
+ * ===========================================================================
+ * Resets the allocator in a new child. Every lock is reinitialized rather
+ * than unlocked, as the child's thread is not the one that took them. Only
+ * the forking thread survives, so the other threads' caches are dropped
+ * from the registry without being flushed: the objects in them stay
+ * allocated (at most tcache_max per class per thread), which is cheaper
+ * than walking them in a child that may exec or exit right away.
+ * ===========================================================================
+ */
+static void fork_child(void)
+{
+    for (unsigned int i = 0; i < g_num_arenas; i++) {
+        pthread_mutex_init(&g_arenas[i].lock, NULL);
+    }
+    pthread_mutex_init(&g_large.lock, NULL);
+    pthread_mutex_init(&g_slab_lock, NULL);
+    pthread_mutex_init(&g_retained.lock, NULL);
+    pthread_mutex_init(&g_large_cache.lock, NULL);
+    pthread_mutex_init(&g_stats_lock, NULL);
+    pthread_mutex_init(&g_quarantine.lock, NULL);
+    pthread_mutex_init(&g_prof.lock, NULL);
+
+    struct tcache *self = &t_cache;
+    for (struct tcache *cache = g_threads; cache != NULL; cache = cache->next_thread) {
+        if (cache != self) {
+            stats_fold(&g_exited_stats, &cache->stats);
+        }
+    }
+    g_threads = NULL;
+    if (self->registered && !self->dead) {
+        self->prev_thread = NULL;
+        self->next_thread = NULL;
+        g_threads = self;
+    }
+
+    // Threads do not survive fork
+    if (g_config.decay_thread) {
+        decay_start();
+    }
+}
+
+/**
+ * allocator_load
+ * ===========================================================================
+ * Runs the one-time setup when the library is loaded. Allocations made
+ * before constructors run (by the dynamic loader or other libraries) run it
+ * on demand instead. Also installs the fork handlers (which may allocate,
+ * so not from allocator_init) and the dump and profile signal handlers, and
+ * starts the decay thread, if enabled.
+ * ===========================================================================
+ */
+__attribute__((constructor))
+static void allocator_load(void)
+{
+    pthread_once(&g_init_once, allocator_init);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    if (g_config.dump_signal != 0) {
+        struct sigaction action = { .sa_handler = dump_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&action.sa_mask);
+        sigaction(g_config.dump_signal, &action, NULL);
+    }
+    if (g_config.prof_sample != 0) {
+        prof_init();
+        if (g_config.prof_signal != 0) {
+            struct sigaction action = { .sa_handler = prof_signal, .sa_flags = SA_RESTART };
+            sigemptyset(&action.sa_mask);
+            sigaction(g_config.prof_signal, &action, NULL);
+        }
+    }
+    if (g_config.decay_thread) {
+        decay_start();
+    }
+}
+
+/**
+ * arena_get
+ * ===========================================================================
+ * Returns the calling thread's arena, assigning one on first use. In NUMA
+ * mode, the arena serves the node the thread is running on at that point,
+ * so threads should be pinned before they first allocate.
+ * ===========================================================================
+ */
+static struct arena *arena_get(void)
+{
+    if (t_arena == NULL) {
+        pthread_once(&g_init_once, allocator_init);
+        unsigned int cpu, node;
+        unsigned int idx;
+        if (g_num_nodes > 1 && getcpu(&cpu, &node) == 0 && node < g_num_nodes) {
+            // Arenas node, node + g_num_nodes, ... serve this node
+            unsigned int local = (g_num_arenas - node + g_num_nodes - 1)
+                / g_num_nodes;
+            unsigned int *next = &g_node_next[node];
+            unsigned int turn = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+            idx = node + g_num_nodes * (turn % local);
+        } else {
+            idx = __atomic_fetch_add(&g_next_arena, 1, __ATOMIC_RELAXED) % g_num_arenas;
+        }
+        t_arena = &g_arenas[idx];
+    }
+    return t_arena;
+}
+
+/**
+ * slab_space_init
+ * ===========================================================================
+ * Reserves the address range slabs are carved from. The range is mapped
+ * PROT_NONE, so it costs no memory until slabs are handed out. If it cannot
+ * be reserved, small requests fall back to ordinary blocks.
+ * ===========================================================================
+ */
+static void slab_space_init(void)
+{
+    void *space = mmap(NULL, SLAB_SPACE + SLAB_SIZE, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (space == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    g_slab_space = (char *) (((uintptr_t) space + SLAB_SIZE - 1)
+            & ~((uintptr_t) SLAB_SIZE - 1));
+}
+
+/**
+ * slab_of
+ * ===========================================================================
+ * Returns the slab holding ptr, or NULL if ptr is not a slab object. Slabs
+ * are aligned to their size, so the descriptor is found by masking.
+ * ===========================================================================
+ */
+static struct slab *slab_of(void *ptr)
+{
+    if (g_slab_space == NULL
+            || (uintptr_t) ptr - (uintptr_t) g_slab_space >= SLAB_SPACE) {
+        return NULL;
+    }
+    return (struct slab *) ((uintptr_t) ptr & ~((uintptr_t) SLAB_SIZE - 1));
+}
+
+static void slab_link(struct slab *slab)
+{
+    struct arena *arena = slab->arena;
+    slab->prev = NULL;
+    slab->next = arena->slabs[slab->cls];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    arena->slabs[slab->cls] = slab;
+}
+
+static void slab_unlink(struct slab *slab)
+{
+    struct arena *arena = slab->arena;
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->slabs[slab->cls] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * slab_new
+ * ===========================================================================
+ * Takes a slab from the released-slab list, or carves a fresh one from the
+ * reservation, and sets it up for objects of one small class. The caller
+ * must hold the arena's lock. Returns NULL once the reservation is used up.
+ * ===========================================================================
+ */
+static struct slab *slab_new(struct arena *arena, unsigned int cls)
+{
+    pthread_once(&g_slab_once, slab_space_init);
+    if (g_slab_space == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_slab_lock);
+    struct slab *slab = g_free_slabs;
+    if (slab != NULL) {
+        g_free_slabs = slab->next;
+    } else if (g_slab_used < SLAB_SPACE) {
+        slab = (struct slab *) (g_slab_space + g_slab_used);
+        if (mprotect(slab, SLAB_SIZE, PROT_READ | PROT_WRITE) == -1) {
+            perror("mprotect");
+            slab = NULL;
+        } else {
+            g_slab_used += SLAB_SIZE;
+            stats_map(SLAB_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&g_slab_lock);
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    // A released slab's pages were dropped, so they follow the new policy
+    numa_bind(slab, SLAB_SIZE, arena->node);
+    slab->arena = arena;
+    slab->cls = cls;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER) / g_small_classes[cls];
+    slab->used = 0;
+    slab->hint = 0;
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    for (unsigned int i = 0; i < slab->capacity / 64; i++) {
+        slab->free_map[i] = ~0UL;
+    }
+    if (slab->capacity % 64 != 0) {
+        slab->free_map[slab->capacity / 64] = (1UL << (slab->capacity % 64)) - 1;
+    }
+    slab_link(slab);
+    return slab;
+}
+
+/**
+ * slab_alloc
+ * ===========================================================================
+ * Hands out one object of a small class from the arena's partially used
+ * slabs, starting a new slab if there are none. Full slabs drop off the
+ * list. The caller must hold the arena's lock.
+ * ===========================================================================
+ */
+static void *slab_alloc(struct arena *arena, unsigned int cls)
+{
+    struct slab *slab = arena->slabs[cls];
+    if (slab == NULL && (slab = slab_new(arena, cls)) == NULL) {
+        return NULL;
+    }
+
+    unsigned int word = slab->hint;
+    while (slab->free_map[word] == 0) {
+        word++;
+    }
+    unsigned int bit = __builtin_ctzl(slab->free_map[word]);
+    slab->free_map[word] &= ~(1UL << bit);
+    slab->hint = word;
+    if (++slab->used == slab->capacity) {
+        slab_unlink(slab);
+    }
+    return (char *) slab + SLAB_HEADER
+        + (word * 64 + bit) * g_small_classes[cls];
+}
+
+/**
+ * slab_free
+ * ===========================================================================
+ * Returns an object to its slab. A slab that becomes empty while the arena
+ * has other partial slabs of its class is released: its pages are dropped
+ * and the slab goes on the list any arena can reuse. The caller must hold
+ * the lock of the arena owning the slab.
+ * ===========================================================================
+ */
+static void slab_free(struct slab *slab, void *ptr)
+{
+    unsigned int idx = ((char *) ptr - ((char *) slab + SLAB_HEADER))
+        / g_small_classes[slab->cls];
+    slab->free_map[idx / 64] |= 1UL << (idx % 64);
+    if (idx / 64 < slab->hint) {
+        slab->hint = idx / 64;
+    }
+    if (slab->used-- == slab->capacity) {
+        slab_link(slab);
+    }
+
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        slab_unlink(slab);
+        // Dropping the pages also clears the descriptor, so a released slab
+        // reads as having no arena
+        madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+        pthread_mutex_lock(&g_slab_lock);
+        slab->next = g_free_slabs;
+        g_free_slabs = slab;
+        pthread_mutex_unlock(&g_slab_lock);
+    }
+}
+
+/**
+ * small_alloc
+ * ===========================================================================
+ * Allocates one object of a small class, from a slab when possible and as
+ * an ordinary block otherwise. The caller must hold the arena's lock.
+ * ===========================================================================
+ */
+static void *small_alloc(struct arena *arena, unsigned int cls)
+{
+    void *ptr = slab_alloc(arena, cls);
+    if (ptr == NULL) {
+        size_t align = g_config.cacheline_classes != 0
+            && g_small_classes[cls] % CACHE_LINE == 0 ? CACHE_LINE : MIN_ALIGN;
+        ptr = alloc_block(arena, g_small_classes[cls], align, NULL);
+    }
+    return ptr;
+}
+
+/**
+ * pagemap_child
+ * ===========================================================================
+ * Returns the node in slot, mapping a zeroed one into it first if it is
+ * empty and create is set. Racing threads both map a node; the loser unmaps
+ * its own and uses the winner's. Returns NULL if there is no node.
+ * ===========================================================================
+ */
+static void *pagemap_child(void **slot, bool create)
+{
+    void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (node != NULL || !create) {
+        return node;
+    }
+    void *fresh = mmap(NULL, PAGEMAP_FANOUT * sizeof(void *),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (__atomic_compare_exchange_n(slot, &node, fresh, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return fresh;
+    }
+    munmap(fresh, PAGEMAP_FANOUT * sizeof(void *));
+    return node;
+}
+
+/**
+ * pagemap_leaf_of
+ * ===========================================================================
+ * Returns the leaf covering page number page (creating it if asked to), or
+ * NULL if there is none or the page lies beyond the range the map covers.
+ * ===========================================================================
+ */
+static struct pagemap_leaf *pagemap_leaf_of(uintptr_t page, bool create)
+{
+    if (page >> (3 * PAGEMAP_BITS) != 0) {
+        return NULL;
+    }
+    struct pagemap_node *node = pagemap_child(
+            (void **) &g_pagemap[page >> (2 * PAGEMAP_BITS)], create);
+    if (node == NULL) {
+        return NULL;
+    }
+    return pagemap_child(
+            (void **) &node->leaves[(page >> PAGEMAP_BITS) & (PAGEMAP_FANOUT - 1)],
+            create);
+}
+
+/**
+ * pagemap_set
+ * ===========================================================================
+ * Records owner as the owner of every page overlapping [addr, addr + len),
+ * or forgets those pages if owner is NULL. Entries must be cleared while the
+ * caller still holds the mapping, before it can be handed to anyone else.
+ * Returns false if a node of the map could not be mapped.
+ * ===========================================================================
+ */
+static bool pagemap_set(void *addr, size_t len, struct mem_block *owner)
+{
+    uintptr_t last = ((uintptr_t) addr + len - 1) >> PAGEMAP_SHIFT;
+    for (uintptr_t page = (uintptr_t) addr >> PAGEMAP_SHIFT; page <= last; page++) {
+        struct pagemap_leaf *leaf = pagemap_leaf_of(page, owner != NULL);
+        if (leaf == NULL) {
+            if (owner != NULL) {
+                return false;
+            }
+            continue;
+        }
+        __atomic_store_n(&leaf->owner[page & (PAGEMAP_FANOUT - 1)], owner,
+                __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+/**
+ * pagemap_get
+ * ===========================================================================
+ * Returns the owner recorded for the page holding ptr, or NULL if the page
+ * is not one of ours. Never takes a lock.
+ * ===========================================================================
+ */
+static struct mem_block *pagemap_get(void *ptr)
+{
+    uintptr_t page = (uintptr_t) ptr >> PAGEMAP_SHIFT;
+    struct pagemap_leaf *leaf = pagemap_leaf_of(page, false);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf->owner[page & (PAGEMAP_FANOUT - 1)],
+            __ATOMIC_ACQUIRE);
+}
+
+/**
+ * block_of
+ * ===========================================================================
+ * Returns the header of the arena block or large object at ptr, or NULL if
+ * ptr cannot be one: it lies outside every region we own (a pointer from
+ * another allocator, say), is misaligned, or points into a large object
+ * rather than at its start.
+ * ===========================================================================
+ */
+static struct mem_block *block_of(void *ptr)
+{
+    struct mem_block *owner = pagemap_get(ptr);
+    if (owner == NULL || ((uintptr_t) ptr & (MIN_ALIGN - 1)) != 0) {
+        return NULL;
+    }
+    if (owner->arena == &g_large) {
+        return owner + 1 == ptr ? owner : NULL;
+    }
+    if ((char *) ptr < (char *) (owner + 1)) {
+        return NULL;
+    }
+    return (struct mem_block *) ptr - 1;
+}
+
+/**
+ * release
+ * ===========================================================================
+ * Returns a slab object or arena block to its owner, whose lock the caller
+ * must hold.
+ * ===========================================================================
+ */
+static void release(void *ptr)
+{
+    struct slab *slab = slab_of(ptr);
+    if (slab != NULL) {
+        slab_free(slab, ptr);
+    } else {
+        free_block((struct mem_block *) ptr - 1);
+    }
+}
+
+/**
+ * owner_of
+ * ===========================================================================
+ * Returns the arena a slab object or arena block belongs to.
+ * ===========================================================================
+ */
+static struct arena *owner_of(void *ptr)
+{
+    struct slab *slab = slab_of(ptr);
+    if (slab != NULL) {
+        return slab->arena;
+    }
+    return ((struct mem_block *) ptr - 1)->arena;
+}
+
+/**
+ * numa_local
+ * ===========================================================================
+ * Whether a freed slab object or arena block may go to the calling thread's
+ * cache. In NUMA mode, memory of another node's arena goes straight back to
+ * its owner instead, so it is not handed out again far from its pages.
+ * ===========================================================================
+ */
+static inline bool numa_local(void *ptr)
+{
+    return g_num_nodes == 1 || owner_of(ptr)->node == arena_get()->node;
+}
+
+static void tcache_push(struct tcache_bin *bin, void *ptr)
+{
+    *(void **) ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+}
+
+static void *tcache_pop(struct tcache_bin *bin)
+{
+    void *ptr = bin->head;
+    bin->head = *(void **) ptr;
+    bin->count--;
+    return ptr;
+}
+
+/**
+ * tcache_flush
+ * ===========================================================================
+ * Returns cached blocks to the arenas that own them until only keep remain.
+ * An arena lock is held across consecutive blocks from the same arena, so a
+ * batch from a single arena takes its lock only once. Blocks of arenas
+ * other than the thread's own are chained and handed to their remote lists
+ * instead, one push per run of consecutive blocks from the same arena.
+ * ===========================================================================
+ */
+static void tcache_flush(struct tcache_bin *bin, unsigned int keep)
+{
+    struct arena *locked = NULL;
+    struct arena *remote = NULL;
+    void *first = NULL;
+    void *last = NULL;
+    unsigned int chained = 0;
+    while (bin->count > keep) {
+        void *ptr = tcache_pop(bin);
+        struct arena *owner = owner_of(ptr);
+        if (owner != t_arena) {
+            if (owner != remote) {
+                if (remote != NULL) {
+                    remote_free(remote, first, last, chained);
+                }
+                remote = owner;
+                last = ptr;
+                first = NULL;
+                chained = 0;
+            }
+            *(void **) ptr = first;
+            first = ptr;
+            chained++;
+            continue;
+        }
+        if (owner != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            locked = owner;
+            arena_lock(locked);
+        }
+        release(ptr);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    if (remote != NULL) {
+        remote_free(remote, first, last, chained);
+    }
+}
+
+/**
+ * free_space
+ * ===========================================================================
+ * Returns the number of bytes in a block that are not in use. Freed blocks
+ * (usage == 0) are entirely free.
+ * ===========================================================================
+ */
+static size_t free_space(struct mem_block *block)
+{
+    return block->size - block->usage;
+}
+
+/**
+ * binned
+ * ===========================================================================
+ * A block is kept on a free list only if it has room for at least one more
+ * block header; anything smaller can never satisfy a request.
+ * ===========================================================================
+ */
+static bool binned(struct mem_block *block)
+{
+    return free_space(block) > sizeof(struct mem_block);
+}
+
+/**
+ * bin_index
+ * ===========================================================================
+ * Maps an amount of free space to its size class: floor(log2(space)).
+ * ===========================================================================
+ */
+static unsigned int bin_index(size_t space)
+{
+    return (NUM_BINS - 1) - __builtin_clzl(space);
+}
+
+/**
+ * tree_indexed
+ * ===========================================================================
+ * Free space is indexed by the tree rather than the segregated lists when
+ * the policy needs it ordered by size.
+ * ===========================================================================
+ */
+static inline bool tree_indexed(void)
+{
+    return g_config.fit == best_fit || g_config.fit == worst_fit;
+}
+
+/**
+ * tree_before
+ * ===========================================================================
+ * Order of the free space tree: by free space, then by address, so every
+ * key is unique and ties go to the lowest address.
+ * ===========================================================================
+ */
+static inline bool tree_before(struct mem_block *a, struct mem_block *b)
+{
+    size_t space_a = free_space(a);
+    size_t space_b = free_space(b);
+    return space_a < space_b || (space_a == space_b && a < b);
+}
+
+/**
+ * tree_priority
+ * ===========================================================================
+ * Heap priority of a treap node. Hashing the address gives every node a
+ * fixed pseudo-random priority without storing one, which keeps the
+ * expected depth logarithmic.
+ * ===========================================================================
+ */
+static inline uintptr_t tree_priority(struct mem_block *block)
+{
+    return ((uintptr_t) block >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * tree_split
+ * ===========================================================================
+ * Splits the subtree at root into the nodes ordered before key (*lo) and
+ * the rest (*hi).
+ * ===========================================================================
+ */
+static void tree_split(struct mem_block *root, struct mem_block *key,
+        struct mem_block **lo, struct mem_block **hi)
+{
+    if (root == NULL) {
+        *lo = NULL;
+        *hi = NULL;
+    } else if (tree_before(root, key)) {
+        *lo = root;
+        tree_split(root->right, key, &root->right, hi);
+    } else {
+        *hi = root;
+        tree_split(root->left, key, lo, &root->left);
+    }
+}
+
+/**
+ * tree_merge
+ * ===========================================================================
+ * Joins two subtrees, every node of lo ordered before every node of hi.
+ * ===========================================================================
+ */
+static struct mem_block *tree_merge(struct mem_block *lo, struct mem_block *hi)
+{
+    if (lo == NULL) {
+        return hi;
+    }
+    if (hi == NULL) {
+        return lo;
+    }
+    if (tree_priority(lo) > tree_priority(hi)) {
+        lo->right = tree_merge(lo->right, hi);
+        return lo;
+    }
+    hi->left = tree_merge(lo, hi->left);
+    return hi;
+}
+
+/**
+ * tree_insert
+ * ===========================================================================
+ * Adds a block to the subtree at root and returns the new root.
+ * ===========================================================================
+ */
+static struct mem_block *tree_insert(struct mem_block *root, struct mem_block *block)
+{
+    if (root == NULL || tree_priority(block) > tree_priority(root)) {
+        tree_split(root, block, &block->left, &block->right);
+        return block;
+    }
+    if (tree_before(block, root)) {
+        root->left = tree_insert(root->left, block);
+    } else {
+        root->right = tree_insert(root->right, block);
+    }
+    return root;
+}
+
+/**
+ * tree_remove
+ * ===========================================================================
+ * Removes a block from the subtree at root and returns the new root. The
+ * block's free space must not have changed since it was inserted.
+ * ===========================================================================
+ */
+static struct mem_block *tree_remove(struct mem_block *root, struct mem_block *block)
+{
+    if (root == NULL) {
+        return NULL;
+    }
+    if (root == block) {
+        return tree_merge(block->left, block->right);
+    }
+    if (tree_before(block, root)) {
+        root->left = tree_remove(root->left, block);
+    } else {
+        root->right = tree_remove(root->right, block);
+    }
+    return root;
+}
+
+/**
+ * bin_insert
+ * ===========================================================================
+ * Files a block under the free list matching its current free space, or in
+ * the free space tree. Must be called after any change to the block's size
+ * or usage.
+ * ===========================================================================
+ */
+static void bin_insert(struct mem_block *block)
+{
+    if (!binned(block)) {
+        return;
+    }
+
+    struct arena *arena = block->arena;
+    if (tree_indexed()) {
+        arena->tree = tree_insert(arena->tree, block);
+        return;
+    }
+    unsigned int idx = bin_index(free_space(block));
+    block->prev_free = NULL;
+    block->next_free = arena->bins[idx];
+    if (arena->bins[idx] != NULL) {
+        arena->bins[idx]->prev_free = block;
+    }
+    arena->bins[idx] = block;
+    arena->bin_map |= 1UL << idx;
+}
+
+/**
+ * bin_remove
+ * ===========================================================================
+ * Takes a block off its free list or out of the tree. Must be called before
+ * the block's size or usage change, since those determine which list it is
+ * on.
+ * ===========================================================================
+ */
+static void bin_remove(struct mem_block *block)
+{
+    if (!binned(block)) {
+        return;
+    }
+
+    struct arena *arena = block->arena;
+    if (tree_indexed()) {
+        arena->tree = tree_remove(arena->tree, block);
+        return;
+    }
+    unsigned int idx = bin_index(free_space(block));
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        arena->bins[idx] = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (arena->bins[idx] == NULL) {
+        arena->bin_map &= ~(1UL << idx);
+    }
+}
+
+/**
+ * fragmentation
+ * ===========================================================================
+ * External fragmentation: the percentage of free memory that could not be
+ * handed out as one allocation.
+ * ===========================================================================
+ */
+static double fragmentation(size_t total_free, size_t largest_free)
+{
+    if (total_free == 0) {
+        return 0.0;
+    }
+    return 100.0 * (1.0 - (double) largest_free / total_free);
+}
+
+/**
+ * struct dump_buf
+ * ===========================================================================
+ * Output buffer for memory_dump. Lines are formatted into it by hand and
+ * written out with write(2) whenever it fills up, so a dump never allocates
+ * or goes through stdio and can be taken from a signal handler.
+ * ===========================================================================
+ */
+struct dump_buf {
+    int fd;
+    size_t len;
+    char data[1024];
+};
+
+static void dump_flush(struct dump_buf *out)
+{
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(out->fd, out->data + done, out->len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    out->len = 0;
+}
+
+static void dump_str(struct dump_buf *out, const char *str)
+{
+    while (*str != '\0') {
+        if (out->len == sizeof(out->data)) {
+            dump_flush(out);
+        }
+        out->data[out->len++] = *str++;
+    }
+}
+
+static void dump_num(struct dump_buf *out, unsigned long n, unsigned int base)
+{
+    char digits[sizeof(n) * CHAR_BIT + 1];
+    char *digit = digits + sizeof(digits);
+    *--digit = '\0';
+    do {
+        *--digit = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n != 0);
+    dump_str(out, digit);
+}
+
+/* Same output as printf's %p */
+static void dump_ptr(struct dump_buf *out, const void *ptr)
+{
+    if (ptr == NULL) {
+        dump_str(out, "(nil)");
+        return;
+    }
+    dump_str(out, "0x");
+    dump_num(out, (uintptr_t) ptr, 16);
+}
+
+static void dump_region(struct dump_buf *out, const void *start, size_t size)
+{
+    dump_str(out, "[REGION] ");
+    dump_ptr(out, start);
+    dump_str(out, "-");
+    dump_ptr(out, (const char *) start + size);
+    dump_str(out, " ");
+    dump_num(out, size, 10);
+    dump_str(out, "\n");
+}
+
+static void dump_block(struct dump_buf *out, const struct mem_block *block)
+{
+    dump_str(out, "[BLOCK]  ");
+    dump_ptr(out, block);
+    dump_str(out, "-");
+    dump_ptr(out, (const char *) block + block->size);
+    dump_str(out, " (");
+    dump_num(out, block->alloc_id, 10);
+    dump_str(out, ") ");
+    dump_num(out, block->size, 10);
+    dump_str(out, " ");
+    dump_num(out, block->usage, 10);
+    dump_str(out, " ");
+    dump_num(out, block->usage == 0 ? 0 : block->usage - sizeof(struct mem_block), 10);
+    dump_str(out, "\n");
+}
+
+/**
+ * dump_lock
+ * ===========================================================================
+ * Tries to take a lock for a dump, waiting up to about 10ms for its holder.
+ * It never blocks: when the dump runs in a signal handler, the interrupted
+ * thread may be the holder.
+ * ===========================================================================
+ */
+static bool dump_lock(pthread_mutex_t *lock)
+{
+    struct timespec pause = { 0, 100000 };
+    for (int tries = 0; tries < 100; tries++) {
+        if (pthread_mutex_trylock(lock) == 0) {
+            return true;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return false;
+}
+
+/**
+ * memory_dump
+ * ===========================================================================
+ * Writes the current memory state to fd, in the format of print_memory, and
+ * is async-signal-safe. Each arena (and the large-object list) is dumped
+ * under its own lock, so every arena is consistent but the arenas are
+ * snapshots taken one after the other; an arena whose lock cannot be taken
+ * is reported as skipped. Slab occupancy is read without locks.
+ * ===========================================================================
+ */
+static void memory_dump(int fd)
+{
+    struct dump_buf out = { .fd = fd, .len = 0 };
+    size_t total_free = 0;
+    size_t largest_free = 0;
+
+    dump_str(&out, "-- Current Memory State --\n");
+    for (unsigned int i = 0; i < g_num_arenas; i++) {
+        struct arena *arena = &g_arenas[i];
+        if (!dump_lock(&arena->lock)) {
+            dump_str(&out, "-- Arena ");
+            dump_num(&out, i, 10);
+            dump_str(&out, " busy, skipped --\n");
+            continue;
+        }
+        struct mem_block *current_block = arena->head;
+        struct mem_block *current_region = NULL;
+        while (current_block != NULL) {
+            if (current_block->region_start != current_region) {
+                current_region = current_block->region_start;
+                dump_region(&out, current_region, current_region->region_size);
+            }
+            dump_block(&out, current_block);
+            size_t space = free_space(current_block);
+            total_free += space;
+            if (space > largest_free) {
+                largest_free = space;
+            }
+            current_block = current_block->next;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    size_t slab_used = __atomic_load_n(&g_slab_used, __ATOMIC_RELAXED);
+    for (size_t off = 0; off < slab_used; off += SLAB_SIZE) {
+        struct slab *slab = (struct slab *) (g_slab_space + off);
+        if (slab->arena != NULL) {
+            dump_str(&out, "[SLAB]   ");
+            dump_ptr(&out, slab);
+            dump_str(&out, "-");
+            dump_ptr(&out, (char *) slab + SLAB_SIZE);
+            dump_str(&out, " ");
+            dump_num(&out, g_small_classes[slab->cls], 10);
+            dump_str(&out, " ");
+            dump_num(&out, slab->used, 10);
+            dump_str(&out, "/");
+            dump_num(&out, slab->capacity, 10);
+            dump_str(&out, "\n");
+        }
+    }
+    if (dump_lock(&g_large.lock)) {
+        for (struct mem_block *large = g_large.head; large != NULL; large = large->next) {
+            dump_region(&out, large->region_start, large->region_size);
+            dump_block(&out, large);
+        }
+        pthread_mutex_unlock(&g_large.lock);
+    } else {
+        dump_str(&out, "-- Large objects busy, skipped --\n");
+    }
+
+    // Two decimals, without going through printf
+    unsigned long hundredths = fragmentation(total_free, largest_free) * 100 + 0.5;
+    dump_str(&out, "-- Fragmentation: ");
+    dump_num(&out, total_free, 10);
+    dump_str(&out, " free, ");
+    dump_num(&out, largest_free, 10);
+    dump_str(&out, " largest, ");
+    dump_num(&out, hundredths / 100, 10);
+    dump_str(&out, hundredths % 100 < 10 ? ".0" : ".");
+    dump_num(&out, hundredths % 100, 10);
+    dump_str(&out, "% --\n");
+    dump_flush(&out);
+}
+
+/**
+ * dump_signal
+ * ===========================================================================
+ * Handler for the dump_signal option: writes a memory dump to the dump file
+ * (truncating it, so it always holds the latest snapshot), or to stderr if
+ * none is configured.
+ * ===========================================================================
+ */
+static void dump_signal(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    int fd = STDERR_FILENO;
+    if (g_config.dump[0] != '\0') {
+        fd = open(g_config.dump, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd != -1) {
+        memory_dump(fd);
+        if (fd != STDERR_FILENO) {
+            close(fd);
+        }
+    }
+    errno = saved_errno;
+}
+
+/**
+ * print_memory
+ * ===========================================================================
+ * Prints out the current memory state, including both the regions and blocks.
+ * Entries are printed in order, so there is an implied link from the topmost
+ * entry to the next, and so on. Nothing is allocated (see memory_dump), so
+ * this may be called from anywhere, the allocator included.
+ * ===========================================================================
+ */
+void print_memory(void)
+{
+    fflush(stdout);
+    memory_dump(STDOUT_FILENO);
+}
+
+/**
+ * write_memory
+ * ====================================================
+ * -File Logging
+ * -Writes output from print_memory to a file
+ * ====================================================
+ */
+void write_memory(FILE *all_output){
+    fflush(all_output);
+    memory_dump(fileno(all_output));
+}
+
+static int prof_find_self(struct dl_phdr_info *info, size_t size, void *data)
+{
+    (void) size;
+    (void) data;
+    uintptr_t self = (uintptr_t) prof_find_self;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_LOAD) {
+            uintptr_t seg = info->dlpi_addr + phdr->p_vaddr;
+            start = seg < start ? seg : start;
+            end = seg + phdr->p_memsz > end ? seg + phdr->p_memsz : end;
+        }
+    }
+    if (self < start || self >= end) {
+        return 0;
+    }
+    // Linked into the program itself, the caller's frames would match too
+    if (info->dlpi_name[0] != '\0') {
+        g_prof.self_start = start;
+        g_prof.self_end = end;
+    }
+    return 1;
+}
+
+/**
+ * prof_init
+ * ===========================================================================
+ * Maps the profile tables and turns sampling on. Called from the library
+ * constructor rather than allocator_init: the first backtrace() loads
+ * libgcc_s through the dynamic loader, which allocates, and must not happen
+ * inside a malloc called by the loader. The mappings are reserved but only
+ * touched as they fill.
+ * ===========================================================================
+ */
+static void prof_init(void)
+{
+    size_t len = PROF_STACKS * sizeof(struct prof_stack)
+        + 2 * PROF_LIVE * sizeof(struct prof_live);
+    char *tables = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tables == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    g_prof.stacks = (struct prof_stack *) tables;
+    g_prof.live = (struct prof_live *) (g_prof.stacks + PROF_STACKS);
+    g_prof.spare = g_prof.live + PROF_LIVE;
+
+    void *frame;
+    t_prof_busy = true;
+    backtrace(&frame, 1);
+    t_prof_busy = false;
+    dl_iterate_phdr(prof_find_self, NULL);
+    __atomic_store_n(&g_prof_rate, g_config.prof_sample, __ATOMIC_RELEASE);
+}
+
+/**
+ * prof_interval
+ * ===========================================================================
+ * Draws the number of bytes until the next sample from an exponential
+ * distribution with a mean of the sampling rate, so every byte allocated is
+ * equally likely to be sampled whatever the size and pattern of the requests
+ * (as pprof assumes when it scales the samples back up). The logarithm is
+ * computed here from the exponent of the random number and a short atanh
+ * series for its mantissa, to keep libm out of the allocator.
+ * ===========================================================================
+ */
+static size_t prof_interval(void)
+{
+    // xorshift64*; the seed is never 0
+    uint64_t x = t_prof_seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t_prof_seed = x;
+    uint64_t r = (x * 0x2545F4914F6CDD1DULL) | 1;
+
+    // u = r / 2^64 = m * 2^(e - 64), with m in [1, 2): ln(m) = 2 atanh(z)
+    int e = 63 - __builtin_clzll(r);
+    double m = (double) r / (double) (1ULL << e);
+    double z = (m - 1) / (m + 1);
+    double z2 = z * z;
+    double ln_m = 2 * z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 + z2 / 9))));
+    double ln_u = ln_m + (e - 64) * 0.69314718055994530942;
+
+    double interval = -ln_u * g_prof_rate;
+    return interval < 1 ? 1 : (size_t) interval;
+}
+
+static uint64_t prof_hash(void *const *frames, int depth)
+{
+    // FNV-1a over the return addresses
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash ^= (uintptr_t) frames[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+static unsigned int prof_slot(uintptr_t ptr)
+{
+    return (ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 32 & (PROF_LIVE - 1);
+}
+
+/**
+ * prof_unlink
+ * ===========================================================================
+ * Removes a live sample, leaving a tombstone so later entries of its probe
+ * run can still be found by prof_free's unlocked scan. The caller must hold
+ * g_prof.lock.
+ * ===========================================================================
+ */
+static void prof_unlink(struct prof_live *entry)
+{
+    struct prof_stack *stack = &g_prof.stacks[entry->stack];
+    stack->live_count--;
+    stack->live_bytes -= entry->size;
+    __atomic_store_n(&entry->ptr, PROF_DELETED, __ATOMIC_RELAXED);
+}
+
+/**
+ * prof_find
+ * ===========================================================================
+ * Returns the live table entry of ptr, or NULL if it is not a live sample.
+ * Safe without the lock, as a filter: a hit must be confirmed under the lock.
+ * ===========================================================================
+ */
+static struct prof_live *prof_find(struct prof_live *live, uintptr_t ptr)
+{
+    unsigned int i = prof_slot(ptr);
+    for (unsigned int probes = 0; probes < PROF_LIVE; probes++) {
+        uintptr_t cur = __atomic_load_n(&live[i].ptr, __ATOMIC_RELAXED);
+        if (cur == ptr) {
+            return &live[i];
+        }
+        if (cur == PROF_EMPTY) {
+            break;
+        }
+        i = (i + 1) & (PROF_LIVE - 1);
+    }
+    return NULL;
+}
+
+/**
+ * prof_rebuild
+ * ===========================================================================
+ * Copies the live samples into the spare table, dropping the tombstones, and
+ * makes it the current one. The old table is only cleared by the next
+ * rebuild, so a concurrent prof_free still scanning it finishes safely. The
+ * caller must hold g_prof.lock.
+ * ===========================================================================
+ */
+static void prof_rebuild(void)
+{
+    struct prof_live *old = g_prof.live;
+    struct prof_live *fresh = g_prof.spare;
+    memset(fresh, 0, PROF_LIVE * sizeof(struct prof_live));
+    g_prof.live_used = 0;
+    for (unsigned int i = 0; i < PROF_LIVE; i++) {
+        if (old[i].ptr > PROF_DELETED) {
+            unsigned int j = prof_slot(old[i].ptr);
+            while (fresh[j].ptr != PROF_EMPTY) {
+                j = (j + 1) & (PROF_LIVE - 1);
+            }
+            fresh[j] = old[i];
+            g_prof.live_used++;
+        }
+    }
+    g_prof.spare = old;
+    __atomic_store_n(&g_prof.live, fresh, __ATOMIC_RELEASE);
+}
+
+/**
+ * prof_insert
+ * ===========================================================================
+ * Adds ptr to the live samples of the stack at index, unless the table is
+ * full of live entries. The caller must hold g_prof.lock.
+ * ===========================================================================
+ */
+static void prof_insert(uintptr_t key, size_t size, unsigned int index)
+{
+    if (g_prof.live_used >= PROF_LIVE * 3 / 4) {
+        prof_rebuild();
+    }
+    if (g_prof.live_used >= PROF_LIVE * 3 / 4) {
+        return;
+    }
+    struct prof_live *stale = prof_find(g_prof.live, key);
+    if (stale != NULL) {
+        // Freed behind the profile's back (e.g. from a foreign allocator)
+        prof_unlink(stale);
+    }
+    unsigned int i = prof_slot(key);
+    while (g_prof.live[i].ptr > PROF_DELETED) {
+        i = (i + 1) & (PROF_LIVE - 1);
+    }
+    if (g_prof.live[i].ptr == PROF_EMPTY) {
+        g_prof.live_used++;
+    }
+    g_prof.live[i].size = size;
+    g_prof.live[i].stack = index;
+    __atomic_store_n(&g_prof.live[i].ptr, key, __ATOMIC_RELAXED);
+    struct prof_stack *stack = &g_prof.stacks[index];
+    stack->live_count++;
+    stack->live_bytes += size;
+}
+
+/**
+ * prof_record
+ * ===========================================================================
+ * Takes a sample: records the calling stack, starting at the allocator's
+ * caller, and adds ptr to the live samples. Samples from new stacks are
+ * dropped once the stack table is nearly full, as are samples that find the
+ * live table full of live entries.
+ * ===========================================================================
+ */
+static __attribute__((noinline)) void prof_record(void *ptr, size_t size)
+{
+    void *trace[PROF_DEPTH + 4];
+    t_prof_busy = true;
+    int total = backtrace(trace, PROF_DEPTH + 4);
+    t_prof_busy = false;
+
+    // At least prof_record and prof_alloc are the allocator's own
+    int skip = 2;
+    while (skip < total && (uintptr_t) trace[skip] - g_prof.self_start
+            < g_prof.self_end - g_prof.self_start) {
+        skip++;
+    }
+    if (skip == total) {
+        skip = 2;
+    }
+    void **frames = trace + skip;
+    int depth = total - skip < PROF_DEPTH ? total - skip : PROF_DEPTH;
+    if (depth <= 0) {
+        return;
+    }
+    uint64_t hash = prof_hash(frames, depth);
+
+    pthread_mutex_lock(&g_prof.lock);
+    unsigned int index = hash & (PROF_STACKS - 1);
+    struct prof_stack *stack = &g_prof.stacks[index];
+    while (stack->hash != 0 && (stack->hash != hash || stack->depth != (unsigned int) depth
+                || memcmp(stack->frames, frames, depth * sizeof(void *)) != 0)) {
+        index = (index + 1) & (PROF_STACKS - 1);
+        stack = &g_prof.stacks[index];
+    }
+    if (stack->hash == 0) {
+        if (g_prof.nstacks >= PROF_STACKS * 3 / 4) {
+            pthread_mutex_unlock(&g_prof.lock);
+            return;
+        }
+        g_prof.nstacks++;
+        stack->hash = hash;
+        stack->depth = depth;
+        memcpy(stack->frames, frames, depth * sizeof(void *));
+    }
+    stack->alloc_count++;
+    stack->alloc_bytes += size;
+
+    prof_insert((uintptr_t) ptr, size, index);
+    pthread_mutex_unlock(&g_prof.lock);
+}
+
+/**
+ * prof_alloc
+ * ===========================================================================
+ * Called with every allocation while profiling is on. Counts the bytes down
+ * to the next sample; only a sampled allocation takes the lock.
+ * ===========================================================================
+ */
+static __attribute__((noinline)) void prof_alloc(void *ptr, size_t size)
+{
+    if (t_prof_left > size) {
+        t_prof_left -= size;
+        return;
+    }
+    if (t_prof_busy) {
+        return;
+    }
+    if (t_prof_seed == 0) {
+        t_prof_seed = (trace_clock() ^ (uintptr_t) &t_prof_seed) | 1;
+        t_prof_left = prof_interval();
+        if (t_prof_left > size) {
+            t_prof_left -= size;
+            return;
+        }
+    }
+    t_prof_left = prof_interval();
+    prof_record(ptr, size);
+}
+
+/**
+ * prof_free
+ * ===========================================================================
+ * Called with every free while profiling is on. Most pointers were never
+ * sampled and are ruled out by an unlocked scan of the live table. Returns
+ * the sample removed, if any (its ptr is PROF_EMPTY otherwise), so a failed
+ * realloc can put it back with prof_restore.
+ * ===========================================================================
+ */
+static struct prof_live prof_free(void *ptr)
+{
+    struct prof_live sample = { 0 };
+    uintptr_t key = (uintptr_t) ptr;
+    if (prof_find(__atomic_load_n(&g_prof.live, __ATOMIC_ACQUIRE), key) == NULL) {
+        return sample;
+    }
+    pthread_mutex_lock(&g_prof.lock);
+    struct prof_live *entry = prof_find(g_prof.live, key);
+    if (entry != NULL) {
+        sample = *entry;
+        sample.ptr = key;
+        prof_unlink(entry);
+    }
+    pthread_mutex_unlock(&g_prof.lock);
+    return sample;
+}
+
+/**
+ * prof_restore
+ * ===========================================================================
+ * Puts back a sample taken out by prof_free, for a block that turned out not
+ * to be released.
+ * ===========================================================================
+ */
+static void prof_restore(const struct prof_live *sample)
+{
+    if (sample->ptr == PROF_EMPTY) {
+        return;
+    }
+    pthread_mutex_lock(&g_prof.lock);
+    prof_insert(sample->ptr, sample->size, sample->stack);
+    pthread_mutex_unlock(&g_prof.lock);
+}
+
+/**
+ * prof_dump
+ * ===========================================================================
+ * Writes the heap profile to fd in the gperftools heap profile format read
+ * by pprof: a header with the live and total sampled objects and bytes and
+ * the sampling rate, one line per stack, then the process's memory map for
+ * symbolization. Async-signal-safe; nothing is written if the profile stays
+ * locked (see dump_lock).
+ * ===========================================================================
+ */
+static void prof_dump(int fd)
+{
+    if (!dump_lock(&g_prof.lock)) {
+        return;
+    }
+
+    struct dump_buf out = { .fd = fd, .len = 0 };
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (unsigned int i = 0; i < PROF_STACKS; i++) {
+        struct prof_stack *stack = &g_prof.stacks[i];
+        live_count += stack->live_count;
+        live_bytes += stack->live_bytes;
+        alloc_count += stack->alloc_count;
+        alloc_bytes += stack->alloc_bytes;
+    }
+    dump_str(&out, "heap profile: ");
+    dump_num(&out, live_count, 10);
+    dump_str(&out, ": ");
+    dump_num(&out, live_bytes, 10);
+    dump_str(&out, " [");
+    dump_num(&out, alloc_count, 10);
+    dump_str(&out, ": ");
+    dump_num(&out, alloc_bytes, 10);
+    dump_str(&out, "] @ heap_v2/");
+    dump_num(&out, g_prof_rate, 10);
+    dump_str(&out, "\n");
+
+    for (unsigned int i = 0; i < PROF_STACKS; i++) {
+        struct prof_stack *stack = &g_prof.stacks[i];
+        if (stack->hash == 0) {
+            continue;
+        }
+        dump_num(&out, stack->live_count, 10);
+        dump_str(&out, ": ");
+        dump_num(&out, stack->live_bytes, 10);
+        dump_str(&out, " [");
+        dump_num(&out, stack->alloc_count, 10);
+        dump_str(&out, ": ");
+        dump_num(&out, stack->alloc_bytes, 10);
+        dump_str(&out, "] @");
+        for (unsigned int j = 0; j < stack->depth; j++) {
+            dump_str(&out, " ");
+            dump_ptr(&out, stack->frames[j]);
+        }
+        dump_str(&out, "\n");
+    }
+    pthread_mutex_unlock(&g_prof.lock);
+
+    dump_str(&out, "\nMAPPED_LIBRARIES:\n");
+    dump_flush(&out);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps != -1) {
+        ssize_t len;
+        while ((len = read(maps, out.data, sizeof(out.data))) > 0) {
+            out.len = len;
+            dump_flush(&out);
+        }
+        close(maps);
+    }
+}
+
+/**
+ * prof_write
+ * ===========================================================================
+ * Replaces the profile file with the current heap profile.
+ * ===========================================================================
+ */
+static void prof_write(void)
+{
+    int fd = open(g_config.prof, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        prof_dump(fd);
+        close(fd);
+    }
+}
+
+/**
+ * prof_signal
+ * ===========================================================================
+ * Handler for the prof_signal option: writes the heap profile so far.
+ * ===========================================================================
+ */
+static void prof_signal(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    if (g_prof_rate != 0) {
+        prof_write();
+    }
+    errno = saved_errno;
+}
+
+/**
+ * first_fit
+ * ======================================================================
+ * Every block in a list above the request's own size class is known to be
+ * big enough, so the head of the smallest non-empty one is taken in O(1).
+ * The request's own class is only scanned when nothing larger exists.
+ * ======================================================================
+ */
+static struct mem_block *first_fit(struct arena *arena, size_t need)
+{
+    unsigned int idx = bin_index(need);
+    if (idx + 1 < NUM_BINS) {
+        unsigned long larger = arena->bin_map >> (idx + 1);
+        if (larger != 0) {
+            return arena->bins[idx + 1 + __builtin_ctzl(larger)];
+        }
+    }
+
+    struct mem_block *stuff = arena->bins[idx];
+    while (stuff != NULL) {
+        if (free_space(stuff) >= need) {
+            return stuff;
+        }
+        stuff = stuff->next_free;
+    }
+    return NULL;
+}
+
+/**
+ * best_fit
+ * ======================================================================
+ * Finds the block with the least free space that still holds the
+ * request (the lowest addressed one among equals) by descending the
+ * free space tree.
+ * ======================================================================
+ */
+static struct mem_block *best_fit(struct arena *arena, size_t need)
+{
+    struct mem_block *fit = NULL;
+    struct mem_block *node = arena->tree;
+    while (node != NULL) {
+        if (free_space(node) >= need) {
+            fit = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return fit;
+}
+
+/**
+ * worst_fit
+ * ======================================================================
+ * Takes the block with the most free space, the rightmost node of the
+ * free space tree, if it holds the request.
+ * ======================================================================
+ */
+static struct mem_block *worst_fit(struct arena *arena, size_t need)
+{
+    struct mem_block *node = arena->tree;
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->right != NULL) {
+        node = node->right;
+    }
+    return free_space(node) >= need ? node : NULL;
+}
+
+/**
+ * reuse
+ * ======================================================================
+ * Checks to see if any free space available in the block of memory 
+ * 
+ * Free space is looked up in the segregated free lists (or the free
+ * space tree) rather than by walking every block, using the configured
+ * policy (ALLOCATOR_ALGORITHM).
+ * ======================================================================
+ */
+void *reuse(struct arena *arena, size_t size) {
+    struct mem_block *fit = g_config.fit(arena, size + sizeof(struct mem_block));
+    PROBE3(reuse, arena, size + sizeof(struct mem_block), fit);
+    return fit;
+}
+
+/**
+ * now_ms
+ * =======================================================================
+ * Coarse monotonic clock for cache decay; cheap enough to read on every
+ * region release.
+ * =======================================================================
+ */
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * cache_evict
+ * =======================================================================
+ * Unmaps entry i of a region cache and drops it, keeping the remaining
+ * entries in age order. The caller must hold the cache's lock.
+ * =======================================================================
+ */
+static void cache_evict(struct region_cache *cache, int i)
+{
+    struct cached_region *entry = &cache->slots[i];
+    if (munmap(entry->addr, entry->size) == -1) {
+        perror("munmap");
+    } else {
+        stats_unmap(entry->size);
+        if (cache->large) {
+            __atomic_fetch_sub(&g_large_mapped, entry->size, __ATOMIC_RELAXED);
+        }
+    }
+    cache->bytes -= entry->size;
+    cache->count--;
+    memmove(entry, entry + 1, (cache->count - i) * sizeof(*entry));
+}
+
+/**
+ * cache_purge
+ * =======================================================================
+ * Gives an entry's pages back to the kernel while keeping it mapped. With
+ * lazy set, MADV_FREE lets the kernel reclaim them only under memory
+ * pressure; otherwise (or where MADV_FREE is unsupported) MADV_DONTNEED
+ * drops them at once and the region reads as zero afterwards.
+ * =======================================================================
+ */
+static void cache_purge(struct cached_region *entry, bool lazy)
+{
+    if (entry->zeroed || (lazy && entry->purged)) {
+        return;
+    }
+    if (lazy && madvise(entry->addr, entry->size, MADV_FREE) == 0) {
+        entry->purged = true;
+    } else if (madvise(entry->addr, entry->size, MADV_DONTNEED) == 0) {
+        entry->purged = true;
+        entry->zeroed = true;
+    }
+}
+
+/**
+ * cache_decay
+ * =======================================================================
+ * Ages a region cache: entries idle for at least g_config.decay_ms are
+ * unmapped, oldest first, while the cache holds more than
+ * g_config.retain_min bytes, and purged with MADV_FREE otherwise. The
+ * caller must hold the cache's lock.
+ * =======================================================================
+ */
+static void cache_decay(struct region_cache *cache, unsigned long now)
+{
+    int i = 0;
+    while (i < cache->count && now - cache->slots[i].stamp >= g_config.decay_ms) {
+        if (cache->bytes > g_config.retain_min) {
+            cache_evict(cache, i);
+        } else {
+            cache_purge(&cache->slots[i], true);
+            i++;
+        }
+    }
+}
+
+/**
+ * cache_put
+ * =======================================================================
+ * Keeps a freed region, placed on NUMA node node, in a cache of at most
+ * max_slots entries and max_bytes bytes (the high watermark), evicting the
+ * oldest entries to make room. A region that cannot be kept is unmapped.
+ * Also decays the cache.
+ * =======================================================================
+ */
+static void cache_put(struct region_cache *cache, void *addr, size_t size,
+        unsigned int node, unsigned int max_slots, size_t max_bytes)
+{
+    pthread_mutex_lock(&cache->lock);
+    unsigned long now = now_ms();
+    if (max_slots > 0 && size <= max_bytes) {
+        while (cache->count > 0 && (cache->count >= (int) max_slots
+                    || cache->bytes + size > max_bytes)) {
+            cache_evict(cache, 0);
+        }
+        struct cached_region *entry = &cache->slots[cache->count++];
+        entry->addr = addr;
+        entry->size = size;
+        entry->stamp = now;
+        entry->purged = false;
+        entry->zeroed = false;
+        entry->node = node;
+        cache->bytes += size;
+    } else if (munmap(addr, size) == -1) {
+        perror("munmap");
+    } else {
+        stats_unmap(size);
+        if (cache->large) {
+            __atomic_fetch_sub(&g_large_mapped, size, __ATOMIC_RELAXED);
+        }
+    }
+    cache_decay(cache, now);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * cache_take
+ * =======================================================================
+ * Removes and returns the smallest cached region of at least need and at
+ * most limit bytes placed on NUMA node node, storing its size in *size and
+ * whether it is known to be zero in *zeroed. Returns NULL if none fits.
+ * =======================================================================
+ */
+static void *cache_take(struct region_cache *cache, size_t need, size_t limit,
+        unsigned int node, size_t *size, bool *zeroed)
+{
+    void *addr = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    int best = -1;
+    for (int i = 0; i < cache->count; i++) {
+        size_t cached_sz = cache->slots[i].size;
+        if (cached_sz >= need && cached_sz <= limit && cache->slots[i].node == node
+                && (best == -1 || cached_sz < cache->slots[best].size)) {
+            best = i;
+        }
+    }
+    if (best != -1) {
+        struct cached_region *entry = &cache->slots[best];
+        addr = entry->addr;
+        *size = entry->size;
+        *zeroed = entry->zeroed;
+        cache->bytes -= entry->size;
+        cache->count--;
+        memmove(entry, entry + 1, (cache->count - best) * sizeof(*entry));
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return addr;
+}
+
+/**
+ * cache_trim
+ * =======================================================================
+ * Unmaps cached regions, oldest first, until at most pad bytes remain, and
+ * drops the pages of those left with MADV_DONTNEED. Returns true if any
+ * memory was given back.
+ * =======================================================================
+ */
+static bool cache_trim(struct region_cache *cache, size_t pad)
+{
+    pthread_mutex_lock(&cache->lock);
+    bool released = false;
+    while (cache->count > 0 && cache->bytes > pad) {
+        cache_evict(cache, 0);
+        released = true;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        if (!cache->slots[i].zeroed) {
+            cache_purge(&cache->slots[i], false);
+            released = true;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return released;
+}
+
+/**
+ * align_up
+ * =======================================================================
+ * Rounds n up to a multiple of align, which must be a power of two.
+ * =======================================================================
+ */
+static inline uintptr_t align_up(uintptr_t n, size_t align)
+{
+    return (n + align - 1) & ~((uintptr_t) align - 1);
+}
+
+/**
+ * block_align
+ * =======================================================================
+ * Alignment, and size granularity, of arena blocks and large objects.
+ * =======================================================================
+ */
+static inline size_t block_align(void)
+{
+    return g_config.cacheline_blocks ? CACHE_LINE : MIN_ALIGN;
+}
+
+/**
+ * place_block
+ * =======================================================================
+ * Places a block of real_sz bytes whose user data is aligned to align in
+ * the free space of block, which must have room for it. A freed block is
+ * taken over in place when its data is already aligned; otherwise the new
+ * block is split off after the block's usage (or header, if freed), and any
+ * padding needed for alignment stays behind as the block's free space.
+ * The caller must hold the arena's lock.
+ * =======================================================================
+ */
+static void *place_block(struct mem_block *block, size_t real_sz, size_t align)
+{
+    struct arena *arena = block->arena;
+
+    bin_remove(block);
+    if (block->usage == 0 && ((uintptr_t) (block + 1) & (align - 1)) == 0) {
+        // Freed block: take it over in place, leaving the rest of it as
+        // free space for later splits
+        block->alloc_id = __atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+        block->usage = real_sz;
+        block->region_start->live++;
+        bin_insert(block);
+        return block + 1;
+    }
+
+    // Create a new block this_block in the free space, far enough along
+    // that its data lands on an align boundary. For cache-line alignment,
+    // the header also starts past the line the free space begins on, so it
+    // never shares a line with the data of the block before it.
+    uintptr_t start = (uintptr_t) block
+        + (block->usage != 0 ? block->usage : sizeof(struct mem_block));
+    if (align >= CACHE_LINE) {
+        start = align_up(start, CACHE_LINE);
+    }
+    struct mem_block *this_block = (struct mem_block *)
+        (align_up(start + sizeof(struct mem_block), align) - sizeof(struct mem_block));
+    this_block->alloc_id = __atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+    this_block->size = block->size - ((char *) this_block - (char *) block);
+    this_block->usage = real_sz;
+    this_block->region_start = block->region_start;
+    this_block->region_size = block->region_size;
+    this_block->next = block->next;
+    this_block->prev = block;
+    this_block->arena = arena;
+    if (this_block->next != NULL) {
+        this_block->next->prev = this_block;
+    } else {
+        arena->tail = this_block;
+    }
+
+    // The reusable block now ends where the new one starts
+    block->size = (char *) this_block - (char *) block;
+    block->next = this_block;
+    block->region_start->live++;
+    bin_insert(block);
+    bin_insert(this_block);
+    return this_block + 1;
+}
+
+/**
+ * alloc_block
+ * =======================================================================
+ * Carves a block for an (already rounded) request of propd_size bytes,
+ * with its data aligned to align, out of the arena's reusable free space,
+ * or starts a new region (a retained one if possible) if none fits. If
+ * zeroed is not NULL, it is set when the block came from a fresh mapping,
+ * whose pages the kernel zeroed. The caller must hold the arena's lock.
+ * =======================================================================
+ */
+static void *alloc_block(struct arena *arena, size_t propd_size, size_t align,
+        bool *zeroed)
+{
+    // Real size is Sum of proposed size and size of a mem_block struct
+    size_t real_sz = propd_size + sizeof(struct mem_block);
+
+    // Blocks start MIN_ALIGN-aligned, so stricter alignment may cost up to
+    // align - MIN_ALIGN bytes of padding (plus as much again to reach a
+    // cache line, see place_block), plus room to keep the header of a freed
+    // block the new one is split from
+    size_t need = real_sz;
+    if (align > MIN_ALIGN) {
+        need += sizeof(struct mem_block) + align - MIN_ALIGN;
+    }
+    if (align >= CACHE_LINE) {
+        need += CACHE_LINE - MIN_ALIGN;
+    }
+
+    /* Go through list and see if there are any free blocks that actually fit 
+     * what is going to be allocated into memory. */
+    struct mem_block *check_reusable = NULL;
+    check_reusable = reuse(arena, need - sizeof(struct mem_block));
+    if (check_reusable != NULL){ 
+        return place_block(check_reusable, real_sz, align);
+    }
+    
+    int page_sz = getpagesize();
+    size_t num_of_pages = need / page_sz;
+    if((need % page_sz) != 0){
+        num_of_pages++;
+    }
+    // New region size to be set to product of number of pages and page size
+    size_t region_sz = num_of_pages * page_sz;
+
+    // Reuse a retained region before asking the kernel for a new one
+    bool fresh = false;
+    struct mem_block *block = cache_take(&g_retained, region_sz, SIZE_MAX,
+            arena->node, &region_sz, &fresh);
+    if (block == NULL) {
+        // mmap in alloc requests for a new memory region from the kernel
+        block = mmap(
+            NULL, /* Address (we use NULL to let the kernel decide) */
+            region_sz, /* Size of memory block to allocate */
+            PROT_READ | PROT_WRITE, /* Memory protection flags */
+            MAP_PRIVATE | MAP_ANONYMOUS, /* Type of mapping */
+            -1, /* file descriptor */
+            0 /* Offset to start at within the file */);
+
+        if (block == MAP_FAILED){
+            perror("mmap");
+            return NULL;
+        }
+        numa_bind(block, region_sz, arena->node);
+        stats_map(region_sz);
+        fresh = true;
+    }
+
+    // Every page of the region leads back to its first block (see block_of)
+    if (!pagemap_set(block, region_sz, block)) {
+        pagemap_set(block, region_sz, NULL);
+        cache_put(&g_retained, block, region_sz, arena->node, RETAIN_SLOTS,
+                g_config.retain_max);
+        return NULL;
+    }
+
+    PROBE2(region_new, block, region_sz);
+
+    // The region starts out as a single freed block spanning all of it
+    block->size = region_sz;
+    block->region_start = block;
+    block->region_size = region_sz;
+    block->usage = 0;
+    block->live = 0;
+    block->next = NULL;   
+    block->prev = arena->tail;
+    block->arena = arena;
+
+    // Append the new region at the tail of the list
+    if (arena->tail == NULL){
+        arena->head = block;
+    } else{
+        arena->tail->next = block;
+    }
+    arena->tail = block;
+
+    bin_insert(block);
+    if (zeroed != NULL) {
+        *zeroed = fresh;
+    }
+    return place_block(block, real_sz, align);
+}
+
+/**
+ * free_block
+ * ====================================================================
+ * Marks a block as free and retires its region once every block in it is
+ * free: the region is retained for reuse or unmapped (see cache_put). The
+ * caller must hold the lock of the arena owning the block.
+ * ====================================================================
+ */
+static void free_block(struct mem_block *block)
+{
+    struct arena *arena = block->arena;
+    struct mem_block *region = block->region_start;
+
+    // LOG("Free request on allocation = %lu\n", block->alloc_id);
+    bin_remove(block);
+    block->usage = 0;
+    region->live--;
+
+    // Coalesce with the physical neighbours. Blocks in a region are linked
+    // in address order, so the prev/next links act as boundary tags: a
+    // freed block that is not the first in its region is absorbed into its
+    // predecessor's free space. As a result, only the first block of a
+    // region is ever left with usage == 0, and any free space following a
+    // block already belongs to it -- both sides are merged in O(1).
+    struct mem_block *before = block->prev;
+    if (before != NULL && before->region_start == region) {
+        bin_remove(before);
+        before->size += block->size;
+        before->next = block->next;
+        if (block->next != NULL) {
+            block->next->prev = before;
+        } else {
+            arena->tail = before;
+        }
+        block = before;
+    }
+
+    // Once no block is live, everything after the first block has been
+    // coalesced into it, so the region is that one free block
+    if (region->live != 0) {
+        bin_insert(block);
+        return;
+    }
+
+    // Splice the region out between its neighbours in the list
+    PROBE2(region_retire, region, region->region_size);
+    if (region->prev == NULL) {
+        arena->head = region->next;
+    } else {
+        region->prev->next = region->next;
+    }
+    if (region->next == NULL) {
+        arena->tail = region->prev;
+    } else {
+        region->next->prev = region->prev;
+    }
+
+    // Keep the region mapped for reuse, within the retention limits. It
+    // leaves the page map first, while the mapping is still ours.
+    pagemap_set(region, region->region_size, NULL);
+    cache_put(&g_retained, region, region->region_size, arena->node,
+            RETAIN_SLOTS, g_config.retain_max);
+}
+
+/**
+ * large_map
+ * =======================================================================
+ * Maps a fresh region for a large object. Mappings of at least a huge page
+ * are aligned to HUGE_PAGE_SIZE and advised for transparent huge pages, or
+ * backed by MAP_HUGETLB when the hugetlb option is enabled and pages are
+ * reserved. Returns MAP_FAILED on failure.
+ * =======================================================================
+ */
+static void *large_map(size_t region_sz)
+{
+    if (region_sz < HUGE_PAGE_SIZE) {
+        return mmap(NULL, region_sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (g_config.hugetlb && region_sz % HUGE_PAGE_SIZE == 0) {
+        void *huge = mmap(NULL, region_sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (huge != MAP_FAILED) {
+            return huge;
+        }
+    }
+
+    // Over-map by a huge page and trim both ends so the start is aligned
+    char *raw = mmap(NULL, region_sz + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    char *aligned = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1)
+            & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    size_t tail = (raw + region_sz + HUGE_PAGE_SIZE) - (aligned + region_sz);
+    if (tail != 0) {
+        munmap(aligned + region_sz, tail);
+    }
+    madvise(aligned, region_sz, MADV_HUGEPAGE);
+    return aligned;
+}
+
+/**
+ * large_link
+ * =======================================================================
+ * Appends a large object to the tracker list. The caller must hold
+ * g_large.lock.
+ * =======================================================================
+ */
+static void large_link(struct mem_block *block)
+{
+    block->next = NULL;
+    block->prev = g_large.tail;
+    if (g_large.tail == NULL) {
+        g_large.head = block;
+    } else {
+        g_large.tail->next = block;
+    }
+    g_large.tail = block;
+}
+
+/**
+ * large_unlink
+ * =======================================================================
+ * Removes a large object from the tracker list. The caller must hold
+ * g_large.lock.
+ * =======================================================================
+ */
+static void large_unlink(struct mem_block *block)
+{
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        g_large.head = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    } else {
+        g_large.tail = block->prev;
+    }
+}
+
+/**
+ * large_offset
+ * =======================================================================
+ * Offset from the start of a large region at which the header of an object
+ * goes so that its data is aligned to align.
+ * =======================================================================
+ */
+static size_t large_offset(void *region, size_t align)
+{
+    uintptr_t data = (uintptr_t) region + sizeof(struct mem_block);
+    return align_up(data, align) - data;
+}
+
+/**
+ * large_alloc
+ * =======================================================================
+ * Serves a request of at least g_config.large_min bytes with a region of
+ * its own, taken from the cache of recently freed large regions when one
+ * fits without wasting more than half of it. The header sits as far into the
+ * region as needed for the data to be aligned to align; alignments beyond a
+ * page are met by over-mapping. If zeroed is not NULL, it is set when the
+ * object came from a fresh mapping.
+ * =======================================================================
+ */
+static void *large_alloc(size_t propd_size, size_t align, bool *zeroed)
+{
+    size_t real_sz = propd_size + sizeof(struct mem_block);
+    int page_sz = getpagesize();
+
+    // Mappings are page-aligned, so the offset is known up front unless the
+    // alignment is coarser than a page
+    size_t offset = align > (size_t) page_sz ? align : large_offset(NULL, align);
+
+    // Leave room for at least one byte of data, so that even an empty
+    // object's data pointer (the page it is looked up by) lies inside the
+    // region
+    size_t payload = real_sz + (propd_size == 0);
+    size_t region_sz = (offset + payload + page_sz - 1) / page_sz * page_sz;
+    bool fresh = false;
+    unsigned int node = arena_get()->node;
+    char *region = cache_take(&g_large_cache, region_sz, region_sz * 2,
+            node, &region_sz, &fresh);
+    if (region == NULL) {
+        region = large_map(region_sz);
+        if (region == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        numa_bind(region, region_sz, node);
+        stats_map(region_sz);
+        __atomic_fetch_add(&g_large_mapped, region_sz, __ATOMIC_RELAXED);
+        fresh = true;
+    }
+    if (zeroed != NULL) {
+        *zeroed = fresh;
+    }
+
+    struct mem_block *block = (struct mem_block *) (region + large_offset(region, align));
+    block->alloc_id = __atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+    block->size = real_sz;
+    block->usage = real_sz;
+    block->region_start = (struct mem_block *) region;
+    block->region_size = region_sz;
+    block->arena = &g_large;
+    block->node = node;
+    if (!pagemap_set(block + 1, 1, block)) {
+        cache_put(&g_large_cache, region, region_sz, node, g_config.large_cache,
+                region_sz <= g_config.large_cache_max ? SIZE_MAX : 0);
+        return NULL;
+    }
+
+    arena_lock(&g_large);
+    large_link(block);
+    pthread_mutex_unlock(&g_large.lock);
+    return block + 1;
+}
+
+/**
+ * large_free
+ * =======================================================================
+ * Releases a large object. Regions up to g_config.large_cache_max bytes are
+ * kept in a small cache for reuse, evicting (unmapping) the oldest entry when
+ * it is full; larger ones are unmapped right away.
+ * =======================================================================
+ */
+static void large_free(struct mem_block *block)
+{
+    arena_lock(&g_large);
+    large_unlink(block);
+    pthread_mutex_unlock(&g_large.lock);
+
+    pagemap_set(block + 1, 1, NULL);
+    size_t max_bytes = block->region_size <= g_config.large_cache_max ? SIZE_MAX : 0;
+    cache_put(&g_large_cache, block->region_start, block->region_size,
+            block->node, g_config.large_cache, max_bytes);
+}
+
+/**
+ * large_realloc
+ * =======================================================================
+ * Resizes a large object within its own mapping when it fits, trimming any
+ * whole pages it no longer needs, and otherwise grows the mapping with
+ * mremap so the contents are never copied. The object keeps its offset in
+ * the region, so alignments up to a page survive a move. Returns NULL if
+ * the mapping could not be resized.
+ * =======================================================================
+ */
+static void *large_realloc(struct mem_block *block, size_t propd_size)
+{
+    char *region = (char *) block->region_start;
+    size_t offset = (char *) block - region;
+    size_t real_sz = propd_size + sizeof(struct mem_block);
+    int page_sz = getpagesize();
+    size_t region_sz = (offset + real_sz + page_sz - 1) / page_sz * page_sz;
+
+    arena_lock(&g_large);
+    if (region_sz <= block->region_size) {
+        if (region_sz < block->region_size
+                && munmap(region + region_sz, block->region_size - region_sz) == 0) {
+            stats_unmap(block->region_size - region_sz);
+            __atomic_fetch_sub(&g_large_mapped, block->region_size - region_sz,
+                    __ATOMIC_RELAXED);
+            block->region_size = region_sz;
+        }
+        block->size = real_sz;
+        block->usage = real_sz;
+        pthread_mutex_unlock(&g_large.lock);
+        return block + 1;
+    }
+
+    large_unlink(block);
+    pagemap_set(block + 1, 1, NULL);
+    char *moved_region = mremap(region, block->region_size, region_sz,
+            MREMAP_MAYMOVE);
+    if (moved_region == MAP_FAILED) {
+        pagemap_set(block + 1, 1, block);
+        large_link(block);
+        pthread_mutex_unlock(&g_large.lock);
+        return NULL;
+    }
+    struct mem_block *moved = (struct mem_block *) (moved_region + offset);
+    pagemap_set(moved + 1, 1, moved);
+    stats_unmap(moved->region_size);
+    stats_map(region_sz);
+    __atomic_fetch_add(&g_large_mapped, region_sz - moved->region_size,
+            __ATOMIC_RELAXED);
+    moved->size = real_sz;
+    moved->usage = real_sz;
+    moved->region_start = (struct mem_block *) moved_region;
+    moved->region_size = region_sz;
+    large_link(moved);
+    pthread_mutex_unlock(&g_large.lock);
+    return moved + 1;
+}
+
+/**
+ * small_class
+ * =======================================================================
+ * Maps a small request (at most SMALL_MAX bytes) to its index in
+ * g_small_classes: 16-byte steps up to 128, then four classes per
+ * doubling.
+ * =======================================================================
+ */
+static unsigned int small_class(size_t size)
+{
+    if (size <= 128) {
+        return size == 0 ? 0 : (size + 15) / 16 - 1;
+    }
+    unsigned int lg = (NUM_BINS - 1) - __builtin_clzl(size - 1);
+    return 8 + (lg - 7) * 4 + ((size - 1 - (1UL << lg)) >> (lg - 2));
+}
+
+/**
+ * tcache_destroy
+ * =======================================================================
+ * pthread key destructor: hands a dying thread's cached blocks back to the
+ * shared heap. Anything the thread frees after this bypasses the cache.
+ * =======================================================================
+ */
+static void tcache_destroy(void *arg)
+{
+    struct tcache *cache = arg;
+    for (int i = 0; i < NUM_SMALL_CLASSES; i++) {
+        tcache_flush(&cache->bins[i], 0);
+    }
+
+    // Retire the thread's counters into the exited-thread totals
+    pthread_mutex_lock(&g_stats_lock);
+    cache->dead = true;
+    stats_fold(&g_exited_stats, &cache->stats);
+    if (cache->prev_thread != NULL) {
+        cache->prev_thread->next_thread = cache->next_thread;
+    } else {
+        g_threads = cache->next_thread;
+    }
+    if (cache->next_thread != NULL) {
+        cache->next_thread->prev_thread = cache->prev_thread;
+    }
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+static void tcache_key_init(void)
+{
+    pthread_key_create(&g_tcache_key, tcache_destroy);
+}
+
+/**
+ * tcache_get
+ * =======================================================================
+ * Returns the calling thread's cache, or NULL once the thread is exiting.
+ * =======================================================================
+ */
+static struct tcache *tcache_get(void)
+{
+    struct tcache *cache = &t_cache;
+    if (cache->dead) {
+        return NULL;
+    }
+    if (!cache->registered) {
+        pthread_once(&g_tcache_once, tcache_key_init);
+        pthread_setspecific(g_tcache_key, cache);
+        cache->registered = true;
+
+        pthread_mutex_lock(&g_stats_lock);
+        cache->prev_thread = NULL;
+        cache->next_thread = g_threads;
+        if (g_threads != NULL) {
+            g_threads->prev_thread = cache;
+        }
+        g_threads = cache;
+        pthread_mutex_unlock(&g_stats_lock);
+    }
+    return cache;
+}
+
+/**
+ * stats_thread
+ * =======================================================================
+ * Returns the counters to charge an event to: the calling thread's own, or
+ * the shared exited-thread totals once its cache is gone (in which case
+ * updates must be atomic).
+ * =======================================================================
+ */
+static struct alloc_stats *stats_thread(void)
+{
+    struct tcache *cache = tcache_get();
+    return cache != NULL ? &cache->stats : NULL;
+}
+
+#define STAT_ADD(field, n) \
+    do { struct alloc_stats *st_ = stats_thread(); \
+         if (st_ != NULL) st_->field += (n); \
+         else __atomic_fetch_add(&g_exited_stats.field, (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+/**
+ * stat_class
+ * =======================================================================
+ * Counter slot for an allocation of the given usable size: its small class,
+ * or one of the two slots for arena blocks and large objects.
+ * =======================================================================
+ */
+static unsigned int stat_class(size_t size)
+{
+    if (size <= SMALL_MAX && size == g_small_classes[small_class(size)]) {
+        return small_class(size);
+    } else if (size < g_config.large_min) {
+        return STAT_MEDIUM;
+    }
+    return STAT_LARGE;
+}
+
+/**
+ * stats_map / stats_unmap
+ * =======================================================================
+ * Account for memory obtained from or returned to the kernel. Mappings are
+ * rare next to allocations, so these are shared atomic counters.
+ * =======================================================================
+ */
+static void stats_map(size_t bytes)
+{
+    __atomic_fetch_add(&g_nmmap, 1, __ATOMIC_RELAXED);
+    size_t mapped = __atomic_add_fetch(&g_mapped, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&g_peak_mapped, __ATOMIC_RELAXED);
+    while (mapped > peak && !__atomic_compare_exchange_n(&g_peak_mapped,
+                &peak, mapped, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void stats_unmap(size_t bytes)
+{
+    __atomic_fetch_add(&g_nmunmap, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&g_mapped, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * arena_lock
+ * =======================================================================
+ * Locks an arena (or the large-object tracker), counting the acquisition as
+ * contended if another thread already holds it, and releases whatever
+ * other threads freed into it meanwhile (see remote_free).
+ * =======================================================================
+ */
+static void arena_lock(struct arena *arena)
+{
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        STAT_ADD(contended, 1);
+        pthread_mutex_lock(&arena->lock);
+    }
+    remote_drain(arena);
+}
+
+/**
+ * remote_drain
+ * ===========================================================================
+ * Releases everything on an arena's remote list. The whole list is taken
+ * with one exchange, so pushes racing with the drain simply start a new
+ * one. The caller must hold the arena's lock.
+ * ===========================================================================
+ */
+static void remote_drain(struct arena *arena)
+{
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    void *ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void *next = *(void **) ptr;
+        release(ptr);
+        ptr = next;
+    }
+}
+
+/**
+ * remote_free
+ * ===========================================================================
+ * Hands a chain of count slab objects or blocks owned by arena, linked
+ * through their first words from first to last, to the arena's remote list
+ * with a single compare-and-swap instead of taking its lock. They are
+ * released the next time any thread locks the arena (see arena_lock), which
+ * the thread using it does on its next allocation that misses its cache.
+ * Every REMOTE_DRAIN or so frees, the caller also drains the arena itself if
+ * its lock happens to be free, so an idle arena's list stays short.
+ * ===========================================================================
+ */
+static void remote_free(struct arena *arena, void *first, void *last,
+        unsigned int count)
+{
+    void *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **) last = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, first, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    STAT_ADD(remote, count);
+
+    t_remote_frees += count;
+    if (t_remote_frees >= REMOTE_DRAIN) {
+        t_remote_frees = 0;
+        if (pthread_mutex_trylock(&arena->lock) == 0) {
+            remote_drain(arena);
+            pthread_mutex_unlock(&arena->lock);
+        }
+    }
+}
+
+/**
+ * stats_collect
+ * =======================================================================
+ * Sums the counters of every live thread and of threads that have exited.
+ * Live threads keep counting while this runs, so the totals are a close
+ * snapshot rather than an exact one.
+ * =======================================================================
+ */
+static void stats_collect(struct alloc_stats *total)
+{
+    pthread_mutex_lock(&g_stats_lock);
+    *total = g_exited_stats;
+    for (struct tcache *cache = g_threads; cache != NULL; cache = cache->next_thread) {
+        stats_fold(total, &cache->stats);
+    }
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+/**
+ * stats_printf
+ * =======================================================================
+ * Formats one line into a stack buffer and writes it straight to fd, so
+ * reporting never allocates or goes through stdio.
+ * =======================================================================
+ */
+__attribute__((format(printf, 2, 3)))
+static void stats_printf(int fd, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > (int) sizeof(buf) - 1) {
+        len = sizeof(buf) - 1;
+    }
+    if (len > 0 && write(fd, buf, len) == -1) {
+        return;
+    }
+}
+
+/**
+ * malloc_stats
+ * =======================================================================
+ * Prints per-class allocation and free counts, bytes in use and mapped,
+ * mapping syscall counts, peak RSS and lock contention to stderr.
+ * =======================================================================
+ */
+void malloc_stats(void)
+{
+    struct alloc_stats total;
+    stats_collect(&total);
+
+    int fd = STDERR_FILENO;
+    stats_printf(fd, "-- Allocator Statistics --\n");
+    stats_printf(fd, "%-8s %8s %14s %14s\n", "class", "size", "mallocs", "frees");
+    for (int i = 0; i < NUM_STAT_CLASSES; i++) {
+        if (total.nmalloc[i] == 0 && total.nfree[i] == 0) {
+            continue;
+        }
+        if (i < NUM_SMALL_CLASSES) {
+            stats_printf(fd, "%-8d %8zu %14lu %14lu\n", i, g_small_classes[i],
+                    total.nmalloc[i], total.nfree[i]);
+        } else {
+            stats_printf(fd, "%-8s %8s %14lu %14lu\n",
+                    i == STAT_MEDIUM ? "medium" : "large", "-",
+                    total.nmalloc[i], total.nfree[i]);
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    stats_printf(fd, "reallocs:        %lu\n", total.nrealloc);
+    stats_printf(fd, "in use:          %zu bytes\n", total.allocated - total.freed);
+    stats_printf(fd, "mapped:          %zu bytes (peak %zu)\n",
+            __atomic_load_n(&g_mapped, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_peak_mapped, __ATOMIC_RELAXED));
+    stats_printf(fd, "retained:        %zu bytes (%zu large)\n",
+            __atomic_load_n(&g_retained.bytes, __ATOMIC_RELAXED)
+            + __atomic_load_n(&g_large_cache.bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_large_cache.bytes, __ATOMIC_RELAXED));
+    stats_printf(fd, "mmap calls:      %lu\n", __atomic_load_n(&g_nmmap, __ATOMIC_RELAXED));
+    stats_printf(fd, "munmap calls:    %lu\n", __atomic_load_n(&g_nmunmap, __ATOMIC_RELAXED));
+    stats_printf(fd, "peak RSS:        %ld KiB\n", usage.ru_maxrss);
+    stats_printf(fd, "lock contention: %lu\n", total.contended);
+    stats_printf(fd, "remote frees:    %lu\n", total.remote);
+}
+
+/**
+ * mallinfo2
+ * =======================================================================
+ * glibc-compatible summary built from the counters alone; no heap walk.
+ * arena covers arena regions and slabs, hblks/hblkhd the large objects in
+ * use, and keepcost the retained regions malloc_trim would release (cached
+ * large-object regions included).
+ * =======================================================================
+ */
+struct mallinfo2 mallinfo2(void)
+{
+    struct alloc_stats total;
+    stats_collect(&total);
+
+    struct mallinfo2 info;
+    memset(&info, 0, sizeof(info));
+    size_t mapped = __atomic_load_n(&g_mapped, __ATOMIC_RELAXED);
+    size_t large = __atomic_load_n(&g_large_mapped, __ATOMIC_RELAXED);
+    size_t cached = __atomic_load_n(&g_large_cache.bytes, __ATOMIC_RELAXED);
+    info.arena = mapped - large;
+    info.hblks = total.nmalloc[STAT_LARGE] - total.nfree[STAT_LARGE];
+    info.hblkhd = large > cached ? large - cached : 0;
+    info.usmblks = __atomic_load_n(&g_peak_mapped, __ATOMIC_RELAXED);
+    info.uordblks = total.allocated - total.freed;
+    info.fordblks = mapped > info.uordblks ? mapped - info.uordblks : 0;
+    info.keepcost = __atomic_load_n(&g_retained.bytes, __ATOMIC_RELAXED)
+        + __atomic_load_n(&g_large_cache.bytes, __ATOMIC_RELAXED);
+    return info;
+}
+
+/**
+ * mallinfo
+ * =======================================================================
+ * Legacy form of mallinfo2 with int fields, which saturate.
+ * =======================================================================
+ */
+struct mallinfo mallinfo(void)
+{
+    struct mallinfo2 info2 = mallinfo2();
+    struct mallinfo info;
+    memset(&info, 0, sizeof(info));
+#define CLAMP(v) ((v) > INT_MAX ? INT_MAX : (int) (v))
+    info.arena = CLAMP(info2.arena);
+    info.hblks = CLAMP(info2.hblks);
+    info.hblkhd = CLAMP(info2.hblkhd);
+    info.usmblks = CLAMP(info2.usmblks);
+    info.uordblks = CLAMP(info2.uordblks);
+    info.fordblks = CLAMP(info2.fordblks);
+    info.keepcost = CLAMP(info2.keepcost);
+#undef CLAMP
+    return info;
+}
+
+/**
+ * allocator_unload
+ * =======================================================================
+ * Dumps the statistics at exit when ALLOCATOR_STATS=1 or the stats option
+ * is set, and writes the heap profile when profiling.
+ * =======================================================================
+ */
+__attribute__((destructor))
+static void allocator_unload(void)
+{
+    if (g_config.stats) {
+        malloc_stats();
+    }
+    if (g_prof_rate != 0) {
+        prof_write();
+    }
+}
+
+
+/**
+ * malloc_trim
+ * =======================================================================
+ * Gives memory back to the kernel: retained and cached large regions are
+ * unmapped until at most pad bytes of each remain (and those have their
+ * pages dropped), and the whole pages inside every arena's free space are
+ * released with MADV_DONTNEED. Returns 1 if any memory was released.
+ * =======================================================================
+ */
+int malloc_trim(size_t pad)
+{
+    bool released = cache_trim(&g_retained, pad);
+    released |= cache_trim(&g_large_cache, pad);
+
+    pthread_once(&g_init_once, allocator_init);
+    int page_sz = getpagesize();
+    for (unsigned int i = 0; i < g_num_arenas; i++) {
+        struct arena *arena = &g_arenas[i];
+        arena_lock(arena);
+        for (struct mem_block *block = arena->head; block != NULL;
+                block = block->next) {
+            if (!binned(block)) {
+                continue;
+            }
+            uintptr_t used = (uintptr_t) block
+                + (block->usage != 0 ? block->usage : sizeof(struct mem_block));
+            uintptr_t start = align_up(used, page_sz);
+            uintptr_t end = ((uintptr_t) block + block->size) & ~((uintptr_t) page_sz - 1);
+            if (end > start && madvise((void *) start, end - start, MADV_DONTNEED) == 0) {
+                released = true;
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    return released;
+}
+
+/**
+ * decay_main
+ * =======================================================================
+ * Body of the background decay thread: wakes up twice per decay period and
+ * ages both region caches, so idle memory is given back even when the
+ * program stops freeing regions. Signals are left to the program's threads.
+ * =======================================================================
+ */
+static void *decay_main(void *arg)
+{
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    unsigned long period = g_config.decay_ms / 2 + 1;
+    struct timespec ts = { period / 1000, (period % 1000) * 1000000 };
+    for (;;) {
+        nanosleep(&ts, NULL);
+        unsigned long now = now_ms();
+        pthread_mutex_lock(&g_retained.lock);
+        cache_decay(&g_retained, now);
+        pthread_mutex_unlock(&g_retained.lock);
+        pthread_mutex_lock(&g_large_cache.lock);
+        cache_decay(&g_large_cache, now);
+        pthread_mutex_unlock(&g_large_cache.lock);
+    }
+    return NULL;
+}
+
+static void decay_start(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, decay_main, NULL) != 0) {
+        LOGP("Could not start the decay thread\n");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+
+/**
+ * tcache_refill
+ * =======================================================================
+ * Allocates a batch of objects of one class under a single acquisition of
+ * the arena lock; one is returned and the rest are cached.
+ * =======================================================================
+ */
+static void *tcache_refill(struct arena *arena, struct tcache_bin *bin,
+        unsigned int cls)
+{
+    arena_lock(arena);
+    void *ptr = small_alloc(arena, cls);
+    for (unsigned int i = 1; ptr != NULL && i < g_config.tcache_batch; i++) {
+        void *extra = small_alloc(arena, cls);
+        if (extra == NULL) {
+            break;
+        }
+        tcache_push(bin, extra);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+/**
+ * allocate
+ * =======================================================================
+ * -Allocate memory
+ * -Has a pointer that directs to a location of the allocated memory
+ * 
+ * -Small requests are served from the calling thread's cache first
+ * -Check first to see if any memory blocks in use can be reused
+ * -Map new memory region if no memory blocks are used
+ * 
+ * If zeroed is not NULL, it is set when the memory is known to be zero
+ * already (fresh from the kernel), so calloc can skip clearing it.
+ * =======================================================================
+ */
+static void *allocate(size_t propd_size, bool *zeroed)
+{
+    // Sizes this big cannot be mapped, and would wrap once rounded up
+    if (propd_size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = NULL;
+    struct arena *arena = arena_get();
+    struct tcache *cache = NULL;
+    if (propd_size >= g_config.large_min) {
+        ptr = large_alloc(propd_size, block_align(), zeroed);
+    } else if (propd_size <= SMALL_MAX) {
+        unsigned int cls = g_class_map[small_class(propd_size)];
+        propd_size = g_small_classes[cls];
+        if ((cache = tcache_get()) == NULL) {
+            arena_lock(arena);
+            ptr = small_alloc(arena, cls);
+            pthread_mutex_unlock(&arena->lock);
+        } else if (cache->bins[cls].head != NULL) {
+            ptr = tcache_pop(&cache->bins[cls]);
+        } else {
+            ptr = tcache_refill(arena, &cache->bins[cls], cls);
+        }
+    } else {
+        propd_size = align_up(propd_size, block_align());
+        arena_lock(arena);
+        ptr = alloc_block(arena, propd_size, block_align(), zeroed);
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    STAT_ADD(nmalloc[stat_class(propd_size)], 1);
+    STAT_ADD(allocated, propd_size);
+
+    // Check for Scribbling
+    if (g_config.scribble){
+        memset(ptr, 0xAA, propd_size);
+        if (zeroed != NULL) {
+            *zeroed = false;
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * malloc
+ * =======================================================================
+ * Allocates size bytes of uninitialized memory (see allocate).
+ * =======================================================================
+ */
+void *malloc(size_t size)
+{
+    void *ptr = HARDENED() ? hardened_alloc(size, MIN_ALIGN) : allocate(size, NULL);
+    TRACE(TRACE_MALLOC, ptr, 0, size);
+    PROBE2(malloc, ptr, size);
+    PROF_ALLOC(ptr, size);
+    return ptr;
+}
+
+/**
+ * deallocate
+ * ====================================================================
+ * Frees any used memory so as to prevent any segmentation faults. 
+ * Clears memory and offers opportunity to create visual picture of 
+ * the memory being allocated and replaced with other blocks. 
+ *
+ * Blocks of a small size class go back to the calling thread's cache;
+ * a full cache bin is flushed to the shared heap in one batch. Everything
+ * else, and in NUMA mode anything owned by another node, is returned to
+ * the arena that owns it: directly if it is the calling thread's own, and
+ * through the owner's lock-free remote list otherwise. Pointers the page
+ * map does not know (see block_of) are ignored.
+ * ==================================================================== 
+ */
+static void deallocate(void *ptr)
+{   
+    /* 
+        This is separate code that is used to send all information from the 
+        memory output to a text file. This text file will call the script
+        file in tests/viz in order to create a .png image file showing the
+        visualization of the memory allocation program. 
+    */
+
+    if (ptr == NULL) {
+        /* Freeing a NULL pointer does nothing */
+        return;
+    }
+
+    // FILE *file_pic = fopen("tests/viz/mem.txt", "w");
+    // write_memory(file_pic);
+
+    // Small objects of a size class go to the thread cache, whether they
+    // live in a slab or in an ordinary block
+    int cls = -1;
+    size_t user_sz;
+    struct slab *slab = slab_of(ptr);
+    if (slab != NULL) {
+        cls = slab->cls;
+        user_sz = g_small_classes[cls];
+    } else {
+        struct mem_block *block = block_of(ptr);
+        if (block == NULL) {
+            // Not ours: allocated before we were preloaded, or bogus
+            LOG("Ignoring free of foreign pointer %p\n", ptr);
+            return;
+        }
+        user_sz = block->usage - sizeof(struct mem_block);
+        if (block->arena == &g_large) {
+            STAT_ADD(nfree[STAT_LARGE], 1);
+            STAT_ADD(freed, user_sz);
+            large_free(block);
+            return;
+        }
+        if (user_sz <= SMALL_MAX && user_sz == g_small_classes[small_class(user_sz)]) {
+            cls = small_class(user_sz);
+        }
+    }
+    STAT_ADD(nfree[stat_class(user_sz)], 1);
+    STAT_ADD(freed, user_sz);
+
+    struct tcache *cache = NULL;
+    if (cls != -1 && numa_local(ptr) && (cache = tcache_get()) != NULL) {
+        struct tcache_bin *bin = &cache->bins[cls];
+        tcache_push(bin, ptr);
+        if (bin->count > g_config.tcache_max) {
+            tcache_flush(bin, g_config.tcache_max / 2);
+        }
+        return;
+    }
+
+    // Another thread's arena: leave the block for that arena's next locker
+    struct arena *arena = owner_of(ptr);
+    if (arena != t_arena) {
+        remote_free(arena, ptr, ptr, 1);
+        return;
+    }
+    arena_lock(arena);
+    release(ptr);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * free
+ * ====================================================================
+ * Releases the allocation at ptr (see deallocate). It is traced first, as
+ * the address may be handed out again as soon as it is released.
+ * ==================================================================== 
+ */
+void free(void *ptr)
+{
+    if (ptr != NULL) {
+        TRACE(TRACE_FREE, ptr, 0, 0);
+        PROBE1(free, ptr);
+    }
+    PROF_FREE(ptr);
+    if (HARDENED()) {
+        hardened_free(ptr);
+        return;
+    }
+    deallocate(ptr);
+}
+
+
+/**
+ * large_zero
+ * ==================================================================== 
+ * Clears the first size bytes of a large object lazily: only the partial
+ * page holding the header is written, and the object's whole pages are
+ * dropped with MADV_DONTNEED so the kernel hands back zero pages when (and
+ * if) they are touched.
+ * ====================================================================
+ */
+static void large_zero(struct mem_block *block, size_t size)
+{
+    int page_sz = getpagesize();
+    char *data = (char *) (block + 1);
+    char *pages = (char *) align_up((uintptr_t) data, page_sz);
+    char *end = (char *) block->region_start + block->region_size;
+
+    memset(data, 0, pages - data);
+    if (madvise(pages, end - pages, MADV_DONTNEED) != 0) {
+        memset(pages, 0, data + size - pages);
+    }
+}
+
+/**
+ * calloc
+ * ==================================================================== 
+ * While free appears to clear the memory it does not 
+ * actually "clear" details of memory
+ * 
+ * Need to set everything to 0 instead of leaving out wasted memory,
+ * unless it is known to be zero already: fresh mappings come zeroed from
+ * the kernel, and reused large objects are cleared lazily (see
+ * large_zero). Fails with ENOMEM if nmemb * size overflows.
+ * ====================================================================
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    bool zeroed = false;
+    void *ptr;
+    if (HARDENED()) {
+        ptr = hardened_alloc(total, MIN_ALIGN);
+    } else {
+        ptr = allocate(total, &zeroed);
+    }
+    TRACE(TRACE_CALLOC, ptr, 0, total);
+    PROBE2(calloc, ptr, total);
+    PROF_ALLOC(ptr, total);
+    if (ptr == NULL || zeroed) {
+        return ptr;
+    }
+
+    struct mem_block *block = (struct mem_block *) ptr - 1;
+    if (g_hardened == 0 && slab_of(ptr) == NULL && block->arena == &g_large) {
+        large_zero(block, total);
+    } else {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+
+/**
+ * remap_block
+ * ================================================================================
+ * Resizes a block that is alone in its region by remapping the whole region,
+ * letting the kernel move the pages rather than copying them. The caller must
+ * hold the arena's lock. Returns the (possibly moved) block, or NULL if the
+ * mapping could not be resized.
+ * ================================================================================
+ */
+static struct mem_block *remap_block(struct mem_block *block, size_t real_sz)
+{
+    struct arena *arena = block->arena;
+    int page_sz = getpagesize();
+    size_t region_sz = (real_sz + page_sz - 1) / page_sz * page_sz;
+
+    bin_remove(block);
+    size_t old_sz = block->region_size;
+    pagemap_set(block, old_sz, NULL);
+    struct mem_block *moved = mremap(block, old_sz, region_sz, MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED) {
+        pagemap_set(block, old_sz, block);
+        bin_insert(block);
+        return NULL;
+    }
+    pagemap_set(moved, region_sz, moved);
+    stats_unmap(moved->region_size);
+    stats_map(region_sz);
+
+    moved->size = region_sz;
+    moved->usage = real_sz;
+    moved->region_start = moved;
+    moved->region_size = region_sz;
+    if (moved->prev != NULL) {
+        moved->prev->next = moved;
+    } else {
+        arena->head = moved;
+    }
+    if (moved->next != NULL) {
+        moved->next->prev = moved;
+    } else {
+        arena->tail = moved;
+    }
+    bin_insert(moved);
+    return moved;
+}
+
+/**
+ * resize_block
+ * ================================================================================
+ * Tries to resize an arena block without moving its contents: in place when
+ * the block's free space covers the request, or with mremap when the block
+ * is alone in a large region. Returns NULL if the block has to be moved.
+ * ================================================================================
+ */
+static void *resize_block(struct mem_block *block, size_t propd_size)
+{
+    struct arena *arena = block->arena;
+    size_t real_sz = propd_size + sizeof(struct mem_block);
+
+    arena_lock(arena);
+    if (block->size >= real_sz) {
+        bin_remove(block);
+        block->usage = real_sz;
+        bin_insert(block);
+        pthread_mutex_unlock(&arena->lock);
+        return block + 1;
+    }
+
+    bool alone = block->region_start == block
+        && (block->next == NULL || block->next->region_start != block);
+    if (alone && block->region_size >= g_config.remap_min) {
+        struct mem_block *moved = remap_block(block, real_sz);
+        if (moved != NULL) {
+            pthread_mutex_unlock(&arena->lock);
+            return moved + 1;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return NULL;
+}
+
+/**
+ * reallocate
+ * ================================================================================
+ * Changes the size of the memory block pointed to by ptr to size bytes. 
+ * 
+ * Like malloc, re-aligns the request to a small size class or to MIN_ALIGN
+ * bytes.
+ * Shrinking, or growing into the free space that follows the block (coalesced
+ * neighbours included), happens in place. Large objects, and large blocks
+ * alone in their region, are grown with mremap. Anything else, or anything
+ * mremap fails to grow, is moved to a new block. Fails with EINVAL for a
+ * pointer that is not ours.
+ * 
+ * Allocates memory if there is a null pointer to this function with respect to 
+ * the proposed size. 
+ * ================================================================================
+ */
+static void *reallocate(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return allocate(size, NULL);
+    }
+    if (size == 0){
+        deallocate(ptr);
+        return NULL;
+    }
+
+    size_t propd_size = size;
+    if (propd_size <= SMALL_MAX) {
+        propd_size = g_small_classes[g_class_map[small_class(propd_size)]];
+    } else {
+        propd_size = align_up(propd_size, block_align());
+    }
+
+    STAT_ADD(nrealloc, 1);
+    size_t old_sz;
+    void *resized = NULL;
+    struct slab *slab = slab_of(ptr);
+    if (slab != NULL) {
+        // Slab objects stay put as long as the request maps to their class
+        old_sz = g_small_classes[slab->cls];
+        if (propd_size == old_sz) {
+            return ptr;
+        }
+    } else {
+        struct mem_block *block = block_of(ptr);
+        if (block == NULL) {
+            // Its size is unknown, so it cannot be moved either
+            LOG("Cannot resize foreign pointer %p\n", ptr);
+            errno = EINVAL;
+            return NULL;
+        }
+        old_sz = block->usage - sizeof(struct mem_block);
+        if (block->arena == &g_large) {
+            if (propd_size >= g_config.large_min) {
+                // mremap may refuse (a hugetlb region grown to a size that is
+                // not a multiple of the huge page, say): copy instead
+                int saved_errno = errno;
+                resized = large_realloc(block, propd_size);
+                errno = saved_errno;
+            }
+        } else {
+            resized = resize_block(block, propd_size);
+        }
+    }
+    if (resized != NULL) {
+        // Count an in-place resize as freeing the old size and allocating
+        // the new one, so mallocs - frees stays the live count per class
+        STAT_ADD(nfree[stat_class(old_sz)], 1);
+        STAT_ADD(nmalloc[stat_class(propd_size)], 1);
+        STAT_ADD(allocated, propd_size);
+        STAT_ADD(freed, old_sz);
+        return resized;
+    }
+
+    void *new_ptr = allocate(size, NULL);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_sz < size ? old_sz : size);
+    deallocate(ptr);
+    return new_ptr;
+}
+
+/**
+ * realloc
+ * ================================================================================
+ * Resizes or moves the allocation at ptr (see reallocate). Its trace slot and
+ * profile sample are taken first, as a move releases the old address, which
+ * another thread may be handed before the realloc returns. The sample is put
+ * back if the old block survives a failed resize.
+ * ================================================================================
+ */
+void *realloc(void *ptr, size_t size)
+{
+    struct trace_record *rec = g_trace != NULL ? trace_claim() : NULL;
+    struct prof_live sample = { 0 };
+    if (__builtin_expect(g_prof_rate != 0, 0) && ptr != NULL) {
+        sample = prof_free(ptr);
+    }
+    void *new_ptr = HARDENED() ? hardened_realloc(ptr, size) : reallocate(ptr, size);
+    if (rec != NULL) {
+        trace_fill(rec, TRACE_REALLOC, new_ptr, (uintptr_t) ptr, size);
+    }
+    PROBE3(realloc, new_ptr, ptr, size);
+    if (new_ptr == NULL && size != 0) {
+        prof_restore(&sample);
+    }
+    PROF_ALLOC(new_ptr, size);
+    return new_ptr;
+}
+
+/**
+ * allocate_aligned
+ * ================================================================================
+ * Allocates size bytes aligned to align, a power of two. Alignments up to
+ * MIN_ALIGN are what malloc gives anyway. Small requests up to the slab
+ * object alignment take the first size class that is a multiple of align,
+ * since every object of such a class is aligned. Anything else is placed
+ * in an arena block (or a large region) at an aligned offset, with the
+ * padding in front left as reusable free space.
+ * ================================================================================
+ */
+static void *allocate_aligned(size_t align, size_t size)
+{
+    if (align <= MIN_ALIGN) {
+        return allocate(size, NULL);
+    }
+    if (size > PTRDIFF_MAX / 2 || align > PTRDIFF_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = NULL;
+    size_t propd_size = align_up(size, MIN_ALIGN);
+    struct arena *arena = arena_get();
+    bool large = propd_size + align >= g_config.large_min;
+    if (large) {
+        ptr = large_alloc(propd_size, align, NULL);
+    } else if (size <= SMALL_MAX && align <= SLAB_ALIGN) {
+        unsigned int cls = g_class_map[small_class(size)];
+        while (g_small_classes[cls] % align != 0) {
+            cls++;
+        }
+        propd_size = g_small_classes[cls];
+        arena_lock(arena);
+        ptr = slab_alloc(arena, cls);
+        if (ptr == NULL) {
+            ptr = alloc_block(arena, propd_size, align, NULL);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    } else {
+        arena_lock(arena);
+        ptr = alloc_block(arena, propd_size, align, NULL);
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // A large object is freed as one whatever its size (see deallocate)
+    STAT_ADD(nmalloc[large ? STAT_LARGE : stat_class(propd_size)], 1);
+    STAT_ADD(allocated, propd_size);
+
+    if (g_config.scribble){
+        memset(ptr, 0xAA, propd_size);
+    }
+    return ptr;
+}
+
+/**
+ * alloc_aligned
+ * ================================================================================
+ * Entry point shared by the aligned allocation functions.
+ * ================================================================================
+ */
+static void *alloc_aligned(size_t align, size_t size)
+{
+    void *ptr = HARDENED() ? hardened_alloc(size, align) : allocate_aligned(align, size);
+    TRACE(TRACE_MEMALIGN, ptr, align, size);
+    PROBE3(memalign, ptr, align, size);
+    PROF_ALLOC(ptr, size);
+    return ptr;
+}
+
+/**
+ * posix_memalign
+ * ================================================================================
+ * Stores a pointer to size bytes aligned to align in *memptr. Returns EINVAL
+ * unless align is a power of two multiple of sizeof(void *), or ENOMEM if
+ * the memory could not be allocated; errno is left untouched.
+ * ================================================================================
+ */
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    if (align == 0 || align % sizeof(void *) != 0 || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+
+    int saved_errno = errno;
+    void *ptr = alloc_aligned(align, size);
+    if (ptr == NULL) {
+        errno = saved_errno;
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/**
+ * aligned_alloc
+ * ================================================================================
+ * C11 aligned allocation. align must be a power of two; size need not be a
+ * multiple of it.
+ * ================================================================================
+ */
+void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return alloc_aligned(align, size);
+}
+
+/**
+ * memalign
+ * ================================================================================
+ * Obsolete aligned allocation. Like glibc, an align that is not a power of
+ * two is rounded up to the next one.
+ * ================================================================================
+ */
+void *memalign(size_t align, size_t size)
+{
+    if (align > PTRDIFF_MAX / 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align > 1 && (align & (align - 1)) != 0) {
+        align = 1UL << ((NUM_BINS - 1) - __builtin_clzl(align) + 1);
+    }
+    return alloc_aligned(align, size);
+}
+
+/**
+ * valloc / pvalloc
+ * ================================================================================
+ * Page-aligned allocation; pvalloc also rounds the size up to whole pages,
+ * giving one page for a size of 0, as glibc does.
+ * ================================================================================
+ */
+void *valloc(size_t size)
+{
+    return alloc_aligned(getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page_sz = getpagesize();
+    if (size > PTRDIFF_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return alloc_aligned(page_sz, align_up(size != 0 ? size : 1, page_sz));
+}
+
+/**
+ * usable_size
+ * ================================================================================
+ * Returns how many bytes may be used at ptr: the whole size class for a slab
+ * object, or the rounded request for a block (0 for a pointer that is not
+ * ours).
+ * ================================================================================
+ */
+static size_t usable_size(void *ptr)
+{
+    struct slab *slab = slab_of(ptr);
+    if (slab != NULL) {
+        return g_small_classes[slab->cls];
+    }
+    struct mem_block *block = block_of(ptr);
+    return block == NULL ? 0 : block->usage - sizeof(struct mem_block);
+}
+
+/**
+ * malloc_usable_size
+ * ================================================================================
+ * Returns how many bytes may be used at ptr (see usable_size); in hardened
+ * mode, exactly the size requested. Anything up to this size can be written
+ * without reallocating, and realloc preserves all of it.
+ * ================================================================================
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (HARDENED()) {
+        return hardened_size(ptr);
+    }
+    return usable_size(ptr);
+}
+
+/**
+ * hardened
+ * ================================================================================
+ * Slow half of HARDENED(): loads the configuration if that has not happened
+ * yet, then reports whether hardened mode is on.
+ * ================================================================================
+ */
+static bool hardened(void)
+{
+    if (__atomic_load_n(&g_hardened, __ATOMIC_ACQUIRE) < 0) {
+        pthread_once(&g_init_once, allocator_init);
+    }
+    return g_hardened > 0;
+}
+
+/**
+ * hardened_abort
+ * ================================================================================
+ * Reports heap corruption detected in hardened mode and aborts. The message
+ * is written without allocating, as the heap cannot be trusted.
+ * ================================================================================
+ */
+__attribute__((noreturn))
+static void hardened_abort(const char *what, void *ptr)
+{
+    struct dump_buf out = { .fd = STDERR_FILENO, .len = 0 };
+    dump_str(&out, "allocator: ");
+    dump_str(&out, what);
+    dump_str(&out, " at ");
+    dump_ptr(&out, ptr);
+    dump_str(&out, "\n");
+    dump_flush(&out);
+    abort();
+}
+
+/**
+ * struct guard_header
+ * ================================================================================
+ * Sits right before every allocation in guard mode, which has a mapping of its
+ * own: the data ends as close to the trailing PROT_NONE guard page as its
+ * alignment allows, and the gap left is filled with canary bytes.
+ * ================================================================================
+ */
+struct guard_header {
+    void *map;
+    size_t map_size;
+    size_t size;
+
+    /* Address of the data XOR HARDENED_LIVE */
+    uintptr_t key;
+};
+
+/**
+ * hardened_alloc
+ * ================================================================================
+ * Allocates size bytes aligned to align in hardened mode. The data is filled
+ * with POISON_ALLOC and followed by canary bytes up to the end of the usable
+ * space, checked when the allocation is freed. Without guard pages, the last
+ * word of the usable space holds the requested size, keyed with the address
+ * (see hardened_size); 16 extra bytes are requested so that at least 8 of
+ * canary remain.
+ * ================================================================================
+ */
+static void *hardened_alloc(size_t size, size_t align)
+{
+    if (size > PTRDIFF_MAX / 2 || align > PTRDIFF_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char *ptr;
+    size_t end;
+    if (g_config.guard) {
+        size_t page_sz = getpagesize();
+        size_t span = align_up(size, MIN_ALIGN);
+        size_t map_size = align_up(sizeof(struct guard_header) + span + align, page_sz)
+            + page_sz;
+        char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        stats_map(map_size);
+        char *guard = map + map_size - page_sz;
+        mprotect(guard, page_sz, PROT_NONE);
+
+        ptr = (char *) ((uintptr_t) (guard - span) & ~((uintptr_t) align - 1));
+        struct guard_header *header = (struct guard_header *) ptr - 1;
+        header->map = map;
+        header->map_size = map_size;
+        header->size = size;
+        header->key = (uintptr_t) ptr ^ HARDENED_LIVE;
+        end = guard - ptr;
+    } else {
+        ptr = allocate_aligned(align, size + 2 * sizeof(size_t));
+        if (ptr == NULL) {
+            return NULL;
+        }
+        end = usable_size(ptr) - sizeof(size_t);
+        *(size_t *) (ptr + end) = size ^ (uintptr_t) ptr ^ HARDENED_LIVE;
+    }
+    memset(ptr, POISON_ALLOC, size);
+    memset(ptr + size, CANARY_BYTE, end - size);
+    return ptr;
+}
+
+/**
+ * hardened_check
+ * ================================================================================
+ * Validates a live hardened allocation and returns the size requested for it.
+ * *end is set to the end of its canary. Aborts on a double free, a pointer
+ * that is not a live allocation, or an overwritten canary.
+ * ================================================================================
+ */
+static size_t hardened_check(void *ptr, size_t *end)
+{
+    char *data = ptr;
+    size_t size;
+    if (g_config.guard) {
+        // A second free faults here, on the header's protected page
+        struct guard_header *header = (struct guard_header *) ptr - 1;
+        if (header->key != ((uintptr_t) ptr ^ HARDENED_LIVE)) {
+            hardened_abort("invalid pointer", ptr);
+        }
+        size = header->size;
+        *end = (char *) header->map + header->map_size - getpagesize() - data;
+    } else {
+        size_t usable = usable_size(ptr);
+        if (usable < 2 * sizeof(size_t) || ((uintptr_t) ptr & (MIN_ALIGN - 1)) != 0) {
+            hardened_abort("invalid pointer", ptr);
+        }
+        *end = usable - sizeof(size_t);
+        size_t word = *(size_t *) (data + *end) ^ (uintptr_t) ptr;
+        size = word ^ HARDENED_LIVE;
+        if (size > *end - sizeof(size_t)) {
+            if ((word ^ HARDENED_FREED) <= *end - sizeof(size_t)) {
+                hardened_abort("double free", ptr);
+            }
+            hardened_abort("buffer overflow (size word overwritten)", ptr);
+        }
+    }
+    for (size_t i = size; i < *end; i++) {
+        if ((unsigned char) data[i] != CANARY_BYTE) {
+            hardened_abort("buffer overflow (canary overwritten)", ptr);
+        }
+    }
+    return size;
+}
+
+static size_t hardened_size(void *ptr)
+{
+    size_t end;
+    return hardened_check(ptr, &end);
+}
+
+/**
+ * quarantine_evict
+ * ================================================================================
+ * Releases the oldest quarantined allocation for real. A poisoned allocation
+ * whose poison was disturbed was written to after being freed; a guarded one
+ * would have faulted instead. The caller must hold g_quarantine.lock.
+ * ================================================================================
+ */
+static void quarantine_evict(void)
+{
+    struct quarantine_entry *entry = &g_quarantine.slots[g_quarantine.head];
+    g_quarantine.head = (g_quarantine.head + 1) % QUARANTINE_SLOTS;
+    g_quarantine.count--;
+    g_quarantine.bytes -= entry->bytes;
+
+    if (entry->map != NULL) {
+        munmap(entry->map, entry->bytes);
+        stats_unmap(entry->bytes);
+        return;
+    }
+    unsigned char *data = entry->ptr;
+    for (size_t i = 0; i < entry->bytes; i++) {
+        if (data[i] != POISON_FREE) {
+            hardened_abort("use after free (freed memory written)", entry->ptr);
+        }
+    }
+    deallocate(entry->ptr);
+}
+
+/**
+ * hardened_free
+ * ================================================================================
+ * Frees a hardened allocation: checks it, poisons it and keys its size word
+ * as freed so a second free is caught (or, with guard pages, makes all of
+ * its pages inaccessible), and quarantines it, evicting the oldest
+ * allocations once the quarantine is over its limits.
+ * ================================================================================
+ */
+static void hardened_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    size_t end;
+    size_t size = hardened_check(ptr, &end);
+    struct quarantine_entry entry = { .ptr = ptr };
+    if (g_config.guard) {
+        struct guard_header *header = (struct guard_header *) ptr - 1;
+        entry.map = header->map;
+        entry.bytes = header->map_size;
+        mprotect(header->map, header->map_size, PROT_NONE);
+    } else {
+        memset(ptr, POISON_FREE, end);
+        *(size_t *) ((char *) ptr + end) = size ^ (uintptr_t) ptr ^ HARDENED_FREED;
+        entry.bytes = end;
+    }
+
+    pthread_mutex_lock(&g_quarantine.lock);
+    while (g_quarantine.count == QUARANTINE_SLOTS || (g_quarantine.count > 0
+                && g_quarantine.bytes + entry.bytes > g_config.quarantine)) {
+        quarantine_evict();
+    }
+    unsigned int tail = (g_quarantine.head + g_quarantine.count) % QUARANTINE_SLOTS;
+    g_quarantine.slots[tail] = entry;
+    g_quarantine.count++;
+    g_quarantine.bytes += entry.bytes;
+    if (g_quarantine.bytes > g_config.quarantine) {
+        // Too big to hold back at all; it is the only entry left
+        quarantine_evict();
+    }
+    pthread_mutex_unlock(&g_quarantine.lock);
+}
+
+/**
+ * hardened_realloc
+ * ================================================================================
+ * realloc in hardened mode: always moves the allocation, so stale pointers to
+ * the old copy land in quarantined memory.
+ * ================================================================================
+ */
+static void *hardened_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return hardened_alloc(size, MIN_ALIGN);
+    }
+    if (size == 0) {
+        hardened_free(ptr);
+        return NULL;
+    }
+    size_t old_size = hardened_size(ptr);
+    void *new_ptr = hardened_alloc(size, MIN_ALIGN);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    hardened_free(ptr);
+    return new_ptr;
+}
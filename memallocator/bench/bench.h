@@ -0,0 +1,75 @@
+/**
+ * bench.h
+ * ==============================================================================
+ * Helpers shared by the multi-threaded allocator benchmarks. Each benchmark
+ * takes the number of threads as its first argument and prints one line,
+ *
+ *     <benchmark> <threads> <operations per second>
+ *
+ * which bench/run.sh collects into tables.
+ * ==============================================================================
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*: a fast per-thread random source that never allocates */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline long bench_arg(int argc, char *argv[], int i, long fallback)
+{
+    return argc > i ? atol(argv[i]) : fallback;
+}
+
+static inline void bench_report(const char *name, int threads, double ops,
+        double secs)
+{
+    printf("%s %d %.0f\n", name, threads, secs > 0 ? ops / secs : 0.0);
+}
+
+/**
+ * bench_run
+ * ==============================================================================
+ * Starts threads running fn, each given its own element of args (an array
+ * of records of size bytes), waits for all of them and returns the elapsed
+ * time in seconds.
+ * ==============================================================================
+ */
+static inline double bench_run(int threads, void *(*fn)(void *), void *args,
+        size_t size)
+{
+    pthread_t tids[threads];
+    double start = bench_now();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, fn, (char *) args + i * size) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return bench_now() - start;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/**
+ * cache_scratch.c
+ * ==============================================================================
+ * After the Hoard cache-scratch benchmark, which detects passive false
+ * sharing. The main thread allocates one small object per worker, so the
+ * objects are likely to share cache lines. Each worker frees the object it
+ * was handed, then repeatedly allocates an object of the same size and
+ * writes to it. If the allocator gives the freed object (or a neighbour of
+ * another thread's object) back, the workers keep writing to the same cache
+ * lines and throughput collapses as threads are added.
+ *
+ * Usage: cache_scratch threads [iterations] [writes] [size]
+ * ==============================================================================
+ */
+
+#include "bench.h"
+
+struct scratch_args {
+    char *handed;
+    long iterations;
+    long writes;
+    long size;
+};
+
+static void *scratch_worker(void *arg)
+{
+    struct scratch_args *args = arg;
+    free(args->handed);
+    for (long i = 0; i < args->iterations; i++) {
+        volatile char *obj = malloc(args->size);
+        for (long w = 0; w < args->writes; w++) {
+            for (long b = 0; b < args->size; b++) {
+                obj[b]++;
+            }
+        }
+        free((char *) obj);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = bench_arg(argc, argv, 1, 1);
+    long iterations = bench_arg(argc, argv, 2, 1000);
+    long writes = bench_arg(argc, argv, 3, 1000);
+    long size = bench_arg(argc, argv, 4, 8);
+    if (threads < 1 || size < 1) {
+        fprintf(stderr, "Usage: %s threads [iterations] [writes] [size]\n", argv[0]);
+        return 1;
+    }
+
+    struct scratch_args args[threads];
+    for (int t = 0; t < threads; t++) {
+        args[t].handed = malloc(size);
+        args[t].iterations = iterations;
+        args[t].writes = writes;
+        args[t].size = size;
+    }
+    double secs = bench_run(threads, scratch_worker, args, sizeof(args[0]));
+    bench_report("cache_scratch", threads, (double) threads * iterations * writes,
+            secs);
+    return 0;
+}
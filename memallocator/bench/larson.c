@@ -0,0 +1,110 @@
+/**
+ * larson.c
+ * ==============================================================================
+ * Server simulation after Larson and Krishnan's benchmark. Each thread owns
+ * an array of slots holding objects of random sizes and keeps replacing a
+ * random one: free it, allocate a new one. After every round the thread
+ * hands its slots to a freshly created successor and exits, so objects are
+ * freed by a different thread than the one that allocated them, and thread
+ * caches are constantly created and torn down.
+ *
+ * Usage: larson threads [seconds] [slots] [min_size] [max_size]
+ * ==============================================================================
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define ROUND_OPS 10000
+
+struct larson_chain {
+    void **slots;
+    long nslots;
+    long min_size;
+    long max_size;
+    uint64_t seed;
+    long ops;
+};
+
+static volatile int g_stop = 0;
+static int g_running = 0;
+static pthread_attr_t g_detached;
+
+static void *larson_round(void *arg)
+{
+    struct larson_chain *chain = arg;
+    long span = chain->max_size - chain->min_size + 1;
+    for (int i = 0; i < ROUND_OPS; i++) {
+        long victim = bench_rand(&chain->seed) % chain->nslots;
+        size_t size = chain->min_size + bench_rand(&chain->seed) % span;
+        free(chain->slots[victim]);
+        chain->slots[victim] = malloc(size);
+        memset(chain->slots[victim], 0x5A, size < 64 ? size : 64);
+    }
+    chain->ops += 2 * ROUND_OPS;
+
+    // Hand the slots over to a new thread, as a server replaces workers
+    pthread_t next;
+    if (g_stop || pthread_create(&next, &g_detached, larson_round, chain) != 0) {
+        __atomic_sub_fetch(&g_running, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = bench_arg(argc, argv, 1, 1);
+    long seconds = bench_arg(argc, argv, 2, 2);
+    long nslots = bench_arg(argc, argv, 3, 1000);
+    long min_size = bench_arg(argc, argv, 4, 16);
+    long max_size = bench_arg(argc, argv, 5, 512);
+    if (threads < 1 || nslots < 1 || min_size < 1 || max_size < min_size) {
+        fprintf(stderr, "Usage: %s threads [seconds] [slots] [min_size] [max_size]\n",
+                argv[0]);
+        return 1;
+    }
+
+    struct larson_chain chains[threads];
+    for (int t = 0; t < threads; t++) {
+        chains[t].slots = calloc(nslots, sizeof(void *));
+        chains[t].nslots = nslots;
+        chains[t].min_size = min_size;
+        chains[t].max_size = max_size;
+        chains[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+        chains[t].ops = 0;
+        for (long i = 0; i < nslots; i++) {
+            chains[t].slots[i] = malloc(min_size);
+        }
+    }
+
+    pthread_attr_init(&g_detached);
+    pthread_attr_setdetachstate(&g_detached, PTHREAD_CREATE_DETACHED);
+    g_running = threads;
+    double start = bench_now();
+    for (int t = 0; t < threads; t++) {
+        pthread_t first;
+        if (pthread_create(&first, &g_detached, larson_round, &chains[t]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    sleep(seconds);
+    g_stop = 1;
+    while (__atomic_load_n(&g_running, __ATOMIC_ACQUIRE) != 0) {
+        usleep(1000);
+    }
+    double secs = bench_now() - start;
+
+    double ops = 0;
+    for (int t = 0; t < threads; t++) {
+        ops += chains[t].ops;
+        for (long i = 0; i < nslots; i++) {
+            free(chains[t].slots[i]);
+        }
+        free(chains[t].slots);
+    }
+    bench_report("larson", threads, ops, secs);
+    return 0;
+}
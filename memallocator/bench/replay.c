@@ -0,0 +1,251 @@
+/**
+ * replay.c
+ * ==============================================================================
+ * Replays an allocation trace recorded by allocator.c (see trace.h) and
+ * reports throughput, per-operation latency, peak RSS and fragmentation.
+ *
+ * To measure the allocator:
+ * LD_PRELOAD=$(pwd)/allocator.so bench/replay trace_file
+ *
+ * To measure glibc, run it without LD_PRELOAD. Operations are replayed in
+ * the order they were recorded, on a single thread. Every allocation is
+ * written to, outside the timed section, so RSS reflects what the traced
+ * program touched. Fragmentation is the share of the peak RSS growth not
+ * accounted for by the peak of live requested bytes.
+ * ==============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "../trace.h"
+
+/**
+ * struct live_entry
+ * ==============================================================================
+ * Maps a pointer recorded in the trace to the pointer the replay got for it.
+ * Entries live in an open-addressing table (see live_find) that is mapped
+ * directly, so the replay's own bookkeeping never goes through the allocator
+ * being measured.
+ * ==============================================================================
+ */
+struct live_entry {
+    uint64_t addr;
+    void *ptr;
+    uint64_t size;
+};
+
+static struct live_entry *g_live;
+static size_t g_live_mask;
+
+static void *map_table(size_t bytes)
+{
+    void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // Fault the table in now so it counts towards the baseline RSS
+    memset(table, 0, bytes);
+    return table;
+}
+
+static size_t live_hash(uint64_t addr)
+{
+    return (addr >> 4) * 0x9E3779B97F4A7C15ULL >> 20 & g_live_mask;
+}
+
+/**
+ * live_find
+ * ==============================================================================
+ * Returns the slot holding addr, or the empty slot it would go in.
+ * ==============================================================================
+ */
+static struct live_entry *live_find(uint64_t addr)
+{
+    size_t i = live_hash(addr);
+    while (g_live[i].addr != 0 && g_live[i].addr != addr) {
+        i = (i + 1) & g_live_mask;
+    }
+    return &g_live[i];
+}
+
+/**
+ * live_remove
+ * ==============================================================================
+ * Empties a slot, shifting back later entries of its probe run so lookups
+ * never need tombstones.
+ * ==============================================================================
+ */
+static void live_remove(struct live_entry *entry)
+{
+    size_t hole = entry - g_live;
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & g_live_mask;
+        if (g_live[i].addr == 0) {
+            break;
+        }
+        size_t home = live_hash(g_live[i].addr);
+        // Move the entry into the hole unless its home lies in (hole, i]
+        if (((i - home) & g_live_mask) >= ((i - hole) & g_live_mask)) {
+            g_live[hole] = g_live[i];
+            hole = i;
+        }
+    }
+    g_live[hole].addr = 0;
+}
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long peak_rss_kib(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace_file\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    const struct trace_header *trace = mmap(NULL, st.st_size, PROT_READ,
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace == MAP_FAILED || (size_t) st.st_size < sizeof(*trace)
+            || memcmp(trace->magic, TRACE_MAGIC, sizeof(trace->magic)) != 0
+            || trace->version != TRACE_VERSION
+            || trace->record_size != sizeof(struct trace_record)
+            || (size_t) st.st_size < sizeof(*trace)
+                + trace->capacity * sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    // After the ring wraps, the oldest surviving record follows the newest
+    const struct trace_record *records = (const void *) (trace + 1);
+    uint64_t count = trace->next < trace->capacity ? trace->next : trace->capacity;
+    uint64_t first = trace->next < trace->capacity ? 0 : trace->next % trace->capacity;
+
+    size_t slots = 16;
+    while (slots < count * 2) {
+        slots *= 2;
+    }
+    g_live = map_table(slots * sizeof(struct live_entry));
+    g_live_mask = slots - 1;
+    uint32_t *latency = map_table((count + 1) * sizeof(uint32_t));
+    long base_rss = peak_rss_kib();
+
+    uint64_t ops = 0, skipped = 0, live = 0, peak_live = 0, elapsed = 0;
+    for (uint64_t n = 0; n < count; n++) {
+        const struct trace_record *rec = &records[(first + n) % trace->capacity];
+        struct live_entry *old = NULL;
+        if (rec->op == TRACE_FREE || (rec->op == TRACE_REALLOC && rec->arg != 0)) {
+            old = live_find(rec->op == TRACE_FREE ? rec->addr : rec->arg);
+            if (old->addr == 0) {
+                // Allocated before the surviving part of the ring
+                skipped++;
+                continue;
+            }
+        }
+
+        void *ptr = NULL;
+        uint64_t start = clock_ns();
+        switch (rec->op) {
+            case TRACE_MALLOC:
+                ptr = malloc(rec->size);
+                break;
+            case TRACE_CALLOC:
+                ptr = calloc(1, rec->size);
+                break;
+            case TRACE_MEMALIGN:
+                ptr = memalign(rec->arg, rec->size);
+                break;
+            case TRACE_REALLOC:
+                ptr = realloc(old != NULL ? old->ptr : NULL, rec->size);
+                break;
+            case TRACE_FREE:
+                free(old->ptr);
+                break;
+            default:
+                skipped++;
+                continue;
+        }
+        uint64_t took = clock_ns() - start;
+        latency[ops++] = took > UINT32_MAX ? UINT32_MAX : took;
+        elapsed += took;
+
+        if (old != NULL && (rec->op == TRACE_FREE || rec->size == 0 || ptr != NULL)) {
+            live -= old->size;
+            live_remove(old);
+        }
+        if (ptr != NULL && rec->addr != 0) {
+            memset(ptr, 0xA5, rec->size);
+            struct live_entry *entry = live_find(rec->addr);
+            if (entry->addr != 0) {
+                // The traced address was reused before its free was recorded
+                live -= entry->size;
+            }
+            entry->addr = rec->addr;
+            entry->ptr = ptr;
+            entry->size = rec->size;
+            live += rec->size;
+            if (live > peak_live) {
+                peak_live = live;
+            }
+        }
+    }
+
+    long rss_growth = peak_rss_kib() - base_rss;
+    qsort(latency, ops, sizeof(uint32_t), compare_u32);
+    printf("-- Replay of %s --\n", argv[1]);
+    printf("operations:      %lu (%lu skipped)\n", ops, skipped);
+    printf("throughput:      %.0f ops/sec\n",
+            elapsed == 0 ? 0.0 : ops * 1e9 / elapsed);
+    if (ops > 0) {
+        printf("latency p50:     %u ns\n", latency[ops / 2]);
+        printf("latency p99:     %u ns\n", latency[ops * 99 / 100]);
+        printf("latency max:     %u ns\n", latency[ops - 1]);
+    }
+    printf("peak live:       %lu KiB\n", peak_live / 1024);
+    printf("peak RSS:        %ld KiB above baseline\n", rss_growth);
+    if (rss_growth > 0) {
+        double frag = 100.0 * (1.0 - (double) peak_live / 1024 / rss_growth);
+        printf("fragmentation:   %.2f%%\n", frag < 0 ? 0.0 : frag);
+    }
+    return 0;
+}
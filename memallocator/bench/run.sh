@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Runs the multi-threaded benchmarks with 1, 2, 4, ... up to max_threads
+# threads (the number of online CPUs by default), once with allocator.so
+# preloaded and once with the system allocator, and prints for each run the
+# throughput of both, their ratio, and the allocator's speedup over its own
+# single-threaded run (its scalability curve).
+#
+# Usage: bench/run.sh [max_threads] [allocator.so]
+
+cd "$(dirname "$0")/.." || exit 1
+max=${1:-$(getconf _NPROCESSORS_ONLN)}
+lib=$(realpath "${2:-allocator.so}")
+
+counts=""
+n=1
+while [ "$n" -lt "$max" ]; do
+    counts="$counts $n"
+    n=$((n * 2))
+done
+counts="$counts $max"
+
+# Prints the ops/sec field of a benchmark's report line
+ops() {
+    "$@" 2>/dev/null | awk '{ print $3 }'
+}
+
+for bench in larson threadtest xmalloc cache_scratch; do
+    echo "-- $bench --"
+    printf "%8s %14s %14s %8s %8s\n" threads system allocator ratio speedup
+    base=""
+    for t in $counts; do
+        sys=$(ops "bench/$bench" "$t")
+        ours=$(ops env LD_PRELOAD="$lib" "bench/$bench" "$t")
+        base=${base:-$ours}
+        awk -v t="$t" -v s="$sys" -v o="$ours" -v b="$base" 'BEGIN {
+            printf "%8d %14.0f %14.0f %8.2f %8.2f\n", t, s, o,
+                (s > 0 ? o / s : 0), (b > 0 ? o / b : 0) }'
+    done
+done
@@ -0,0 +1,60 @@
+/**
+ * threadtest.c
+ * ==============================================================================
+ * After the Hoard threadtest benchmark: a fixed amount of work is split
+ * evenly between the threads, each of which repeatedly allocates its share
+ * of objects and then frees them all. Nothing is shared, so an allocator
+ * that scales should finish in time inversely proportional to the thread
+ * count (up to the number of cores).
+ *
+ * Usage: threadtest threads [iterations] [objects] [size]
+ * ==============================================================================
+ */
+
+#include "bench.h"
+
+struct threadtest_args {
+    long iterations;
+    long objects;
+    long size;
+};
+
+static void *threadtest_worker(void *arg)
+{
+    struct threadtest_args *args = arg;
+    void **objs = malloc(args->objects * sizeof(void *));
+    for (long i = 0; i < args->iterations; i++) {
+        for (long j = 0; j < args->objects; j++) {
+            objs[j] = malloc(args->size);
+            *(volatile char *) objs[j] = (char) j;
+        }
+        for (long j = 0; j < args->objects; j++) {
+            free(objs[j]);
+        }
+    }
+    free(objs);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = bench_arg(argc, argv, 1, 1);
+    long iterations = bench_arg(argc, argv, 2, 50);
+    long objects = bench_arg(argc, argv, 3, 100000);
+    long size = bench_arg(argc, argv, 4, 64);
+    if (threads < 1 || objects < threads || size < 1) {
+        fprintf(stderr, "Usage: %s threads [iterations] [objects] [size]\n", argv[0]);
+        return 1;
+    }
+
+    struct threadtest_args args[threads];
+    for (int t = 0; t < threads; t++) {
+        args[t].iterations = iterations;
+        args[t].objects = objects / threads;
+        args[t].size = size;
+    }
+    double secs = bench_run(threads, threadtest_worker, args, sizeof(args[0]));
+    bench_report("threadtest", threads, 2.0 * iterations * (objects / threads) * threads,
+            secs);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * xmalloc.c
+ * ==============================================================================
+ * After xmalloc-test: every object is freed by a different thread than the
+ * one that allocated it. Threads form a ring; each allocates batches of
+ * random-sized objects and pushes them onto its neighbour's inbox, then
+ * frees whatever its own neighbour pushed to it. This stresses remote
+ * frees, where a thread returns memory to an arena it does not use.
+ *
+ * Usage: xmalloc threads [rounds] [batch] [max_size]
+ * ==============================================================================
+ */
+
+#include "bench.h"
+
+/* Objects in flight are chained through their own first word, so passing
+ * them between threads costs no allocations of its own. */
+struct xmalloc_node {
+    struct xmalloc_node *next;
+};
+
+struct xmalloc_thread {
+    /* Lock-free stack of objects pushed by the previous thread */
+    struct xmalloc_node *inbox;
+    struct xmalloc_thread *neighbour;
+    long rounds;
+    long batch;
+    long max_size;
+    uint64_t seed;
+    long ops;
+} __attribute__((aligned(64)));
+
+static long xmalloc_drain(struct xmalloc_thread *self)
+{
+    long freed = 0;
+    struct xmalloc_node *node = __atomic_exchange_n(&self->inbox, NULL, __ATOMIC_ACQUIRE);
+    while (node != NULL) {
+        struct xmalloc_node *next = node->next;
+        free(node);
+        node = next;
+        freed++;
+    }
+    return freed;
+}
+
+static void *xmalloc_worker(void *arg)
+{
+    struct xmalloc_thread *self = arg;
+    for (long r = 0; r < self->rounds; r++) {
+        struct xmalloc_node *head = NULL, *tail = NULL;
+        for (long i = 0; i < self->batch; i++) {
+            size_t size = sizeof(struct xmalloc_node)
+                + bench_rand(&self->seed) % self->max_size;
+            struct xmalloc_node *node = malloc(size);
+            node->next = head;
+            head = node;
+            if (tail == NULL) {
+                tail = node;
+            }
+        }
+        self->ops += self->batch;
+
+        struct xmalloc_thread *to = self->neighbour;
+        tail->next = __atomic_load_n(&to->inbox, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&to->inbox, &tail->next, head, true,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        self->ops += xmalloc_drain(self);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = bench_arg(argc, argv, 1, 1);
+    long rounds = bench_arg(argc, argv, 2, 20000);
+    long batch = bench_arg(argc, argv, 3, 64);
+    long max_size = bench_arg(argc, argv, 4, 512);
+    if (threads < 1 || batch < 1 || max_size < 1) {
+        fprintf(stderr, "Usage: %s threads [rounds] [batch] [max_size]\n", argv[0]);
+        return 1;
+    }
+
+    struct xmalloc_thread *ring = aligned_alloc(64, threads * sizeof(*ring));
+    for (int t = 0; t < threads; t++) {
+        ring[t].inbox = NULL;
+        ring[t].neighbour = &ring[(t + 1) % threads];
+        ring[t].rounds = rounds;
+        ring[t].batch = batch;
+        ring[t].max_size = max_size;
+        ring[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+        ring[t].ops = 0;
+    }
+    double secs = bench_run(threads, xmalloc_worker, ring, sizeof(*ring));
+
+    // Objects pushed after their recipient finished are freed here
+    double ops = 0;
+    for (int t = 0; t < threads; t++) {
+        ops += ring[t].ops;
+        xmalloc_drain(&ring[t]);
+    }
+    free(ring);
+    bench_report("xmalloc", threads, ops, secs);
+    return 0;
+}
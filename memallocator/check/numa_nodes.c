@@ -0,0 +1,35 @@
+/**
+ * numa_nodes.c
+ * ==============================================================================
+ * Checks numa_node_count (see numa.h) against the node list formats the
+ * kernel writes. Run with 'make check'.
+ * ==============================================================================
+ */
+
+#include <stdio.h>
+
+#include "../numa.h"
+
+static int check(const char *list, unsigned long expected)
+{
+    unsigned long count = numa_node_count(list);
+    if (count != expected) {
+        printf("FAIL: \"%s\" gave %lu nodes, expected %lu\n", list, count, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+    failed += check("0\n", 1);
+    failed += check("0-1\n", 2);
+    failed += check("0-1", 2);
+    failed += check("0-3,5\n", 6);
+    failed += check("1,3-4\n", 5);
+    failed += check("0-63\n", 64);
+    failed += check("", 0);
+    printf("%s\n", failed == 0 ? "numa_nodes: ok" : "numa_nodes: FAILED");
+    return failed != 0;
+}
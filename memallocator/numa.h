@@ -0,0 +1,46 @@
+/**
+ * numa.h
+ * ==============================================================================
+ * Parsing of the kernel's node lists for NUMA mode in allocator.c, kept apart
+ * so check/numa_nodes.c can exercise it without loading the allocator.
+ * ==============================================================================
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stdlib.h>
+
+/**
+ * numa_node_count
+ * ==============================================================================
+ * Returns one more than the highest node in a sysfs node list such as
+ * /sys/devices/system/node/online: comma-separated nodes and ranges ("0-3,5"
+ * gives 6), possibly ending in a newline. Returns 0 for an empty list.
+ * ==============================================================================
+ */
+static inline unsigned long numa_node_count(const char *list)
+{
+    unsigned long count = 0;
+    const char *cur = list;
+    while (*cur != '\0') {
+        if (*cur < '0' || *cur > '9') {
+            cur++;
+            continue;
+        }
+        char *end;
+        unsigned long last = strtoul(cur, &end, 10);
+
+        // The upper bound of a range "a-b" is all that matters
+        if (end[0] == '-' && end[1] >= '0' && end[1] <= '9') {
+            last = strtoul(end + 1, &end, 10);
+        }
+        if (last >= count) {
+            count = last + 1;
+        }
+        cur = end;
+    }
+    return count;
+}
+
+#endif
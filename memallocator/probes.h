@@ -0,0 +1,46 @@
+/**
+ * probes.h
+ * ==============================================================================
+ * Static tracepoints in allocator.c. When <sys/sdt.h> (systemtap-sdt-dev) is
+ * available, each PROBEn(name, ...) becomes the USDT probe allocator:name: a
+ * single nop in the code plus an ELF note, which perf, bpftrace or SystemTap
+ * can enable at run time without rebuilding, e.g.
+ *
+ * bpftrace -e 'usdt:./allocator.so:allocator:malloc { @[arg1] = count(); }'
+ *
+ * Without <sys/sdt.h>, or when built with -DNO_PROBES, probes compile to
+ * nothing.
+ *
+ * Probes (arguments in order):
+ * malloc         ptr, size
+ * free           ptr
+ * calloc         ptr, size
+ * realloc        new ptr, old ptr, size
+ * memalign       ptr, alignment, size
+ * reuse          arena, bytes needed, block found (NULL if none)
+ * region_new     region, size    (arena region mapped or taken from cache)
+ * region_retire  region, size    (last block of an arena region freed)
+ * ==============================================================================
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE1(name, a) DTRACE_PROBE1(allocator, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(allocator, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(allocator, name, a, b, c)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * trace.h
+ * ==============================================================================
+ * Format of the allocation trace written by allocator.c when tracing is
+ * enabled (ALLOCATOR_TRACE=path, or trace:path in ALLOCATOR_CONFIG) and read
+ * back by bench/replay.c.
+ *
+ * A trace file is a struct trace_header followed by a ring of capacity
+ * records. Writers claim a slot by atomically incrementing next, so once the
+ * ring wraps the oldest records are overwritten: the trace holds the last
+ * min(next, capacity) operations, starting at slot next % capacity.
+ * ==============================================================================
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "MALTRACE"
+#define TRACE_VERSION 1
+
+/* Default ring capacity, in records */
+#define TRACE_RECORDS (1024 * 1024)
+
+enum trace_op {
+    TRACE_MALLOC = 1,
+    TRACE_FREE,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_MEMALIGN,
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+
+    /* Number of records ever claimed */
+    uint64_t next;
+};
+
+struct trace_record {
+    /* Nanoseconds since tracing started */
+    uint64_t time;
+
+    /* Pointer returned (or freed, for TRACE_FREE); 0 if allocation failed.
+     * Pointers are only used as ids for matching operations up. */
+    uint64_t addr;
+
+    /* TRACE_REALLOC: the pointer being resized; TRACE_MEMALIGN: the
+     * alignment */
+    uint64_t arg;
+
+    /* Bytes requested (nmemb * size for TRACE_CALLOC) */
+    uint64_t size;
+
+    /* Kernel thread id of the caller */
+    uint32_t tid;
+    uint32_t op;
+};
+
+#endif